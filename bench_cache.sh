@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# Cache misses per CAN frame at saturation. Run once with each driver build
+# to compare, results are appended to bench_output.txt.
+# Requires perf (sudo apt-get install linux-perf) and can-utils. The interface
+# is put in internal loopback mode so no other node is needed.
+# Usage: ./bench_cache.sh [interface] [seconds] [comma separated cpus]
+#
+# cangen, the tcan4550 interrupt threads (and with them NAPI) and unbound
+# work queues (tx work) are pinned to the cpu list, and only those cpus are
+# counted. The SPI controller thread is not pinned, its misses are not
+# counted. Use cpus without other load, e.g. isolated with isolcpus.
+
+IF=${1:-can0}
+SECONDS_TO_RUN=${2:-10}
+CPUS=${3:-1}
+STATS=/sys/class/net/$IF/statistics
+WQ_CPUMASK=/sys/devices/virtual/workqueue/cpumask
+
+sudo ip link set $IF down
+sudo ip link set $IF up type can bitrate 1000000 loopback on
+sudo ifconfig $IF txqueuelen 1000
+
+# pin interrupt threads and unbound work queues, restored at the end
+IRQS=$(grep tcan4550 /proc/interrupts | cut -d: -f1 | tr -d ' ')
+declare -A IRQ_AFFINITY
+for irq in $IRQS; do
+	IRQ_AFFINITY[$irq]=$(cat /proc/irq/$irq/smp_affinity_list)
+	echo $CPUS | sudo tee /proc/irq/$irq/smp_affinity_list >/dev/null
+done
+WQ_MASK_SAVED=$(cat $WQ_CPUMASK)
+printf '%x\n' $(( $(echo $CPUS | tr ',' '\n' | while read c; do echo -n "+(1<<$c)"; done) )) |
+	sudo tee $WQ_CPUMASK >/dev/null
+
+rx_start=$(cat $STATS/rx_packets)
+tx_start=$(cat $STATS/tx_packets)
+
+taskset -c $CPUS cangen $IF -g0 -I 123 -L 8 &
+CANGEN_PID=$!
+
+PERF_OUT=$(sudo perf stat -C $CPUS -x, -e cache-misses,L1-dcache-load-misses sleep $SECONDS_TO_RUN 2>&1)
+
+kill $CANGEN_PID
+wait $CANGEN_PID 2>/dev/null
+
+# every frame sent is counted in tx and twice in rx, once as local echo and
+# once when the chip receives it through internal loopback. A frame is one
+# pass through tx and rx path, so only the frames sent are counted.
+rx=$(( $(cat $STATS/rx_packets) - rx_start ))
+tx=$(( $(cat $STATS/tx_packets) - tx_start ))
+frames=$tx
+looped=$(( rx - tx ))
+
+cache_misses=$(echo "$PERF_OUT" | grep ",cache-misses" | cut -d, -f1)
+l1_misses=$(echo "$PERF_OUT" | grep ",L1-dcache-load-misses" | cut -d, -f1)
+
+{
+	echo "$(date) $(modinfo -F srcversion tcan4550 2>/dev/null) cpus $CPUS"
+	echo "frames $frames (received through loopback $looped) in $SECONDS_TO_RUN s"
+	if [ "$frames" -gt 0 ]; then
+		echo "cache-misses per frame $(( cache_misses / frames ))"
+		echo "L1-dcache-load-misses per frame $(( l1_misses / frames ))"
+	fi
+} | tee -a bench_output.txt
+
+echo $WQ_MASK_SAVED | sudo tee $WQ_CPUMASK >/dev/null
+for irq in $IRQS; do
+	echo ${IRQ_AFFINITY[$irq]} | sudo tee /proc/irq/$irq/smp_affinity_list >/dev/null
+done
+
+sudo ip link set $IF down
+sudo ip link set $IF up type can bitrate 1000000 loopback off
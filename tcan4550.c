@@ -6,18 +6,42 @@
 
 #include <linux/can/dev.h>
 #include <linux/can/error.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/ethtool.h>
+#include <linux/fs.h>
 #include <linux/gpio.h>
 #include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
 #include <linux/module.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/net_tstamp.h>
 #include <linux/netdevice.h>
 #include <linux/netlink.h>
 #include <linux/of.h>
+#include <linux/poll.h>
+#include <linux/ptp_clock_kernel.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/timecounter.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "tcan4550_hw.h"
+#include "tcan4550_txring.h"
 
 // 32-bit SPI transfers are a little faster as there is no delay between the
 // bytes in a word. However, for instance Raspberry Pi 4 only support 8-bit
@@ -26,20 +50,11 @@
 //#define USE_32BIT_SPI_TRANSFERS
 //#define MSB_LSB_SWAP
 
-// Message RAM (MRAM) config. User adjustable.
-const static uint32_t RX_SLOT_SIZE = 16; // size of one element in the rx fifo
-const static uint32_t TX_SLOT_SIZE = 16; // size of one element in the tx fifo
-const static uint32_t TX_FIFO_SIZE = 32; // possible values = 0 - 32
-const static uint32_t TX_FIFO_START_ADDRESS = 0x0; // position in MRAM where tx fifo start (excluding MRAM base address)
-const static uint32_t RX_FIFO_SIZE = 64; // possible values = 0 - 64
-const static uint32_t RX_FIFO_START_ADDRESS = 0x200; // position in MRAM where rx fifo start (excluding MRAM base address)
-const static uint32_t EVENT_FIFO_START_ADDRESS = 0x600; // position in MRAM where tx event fifo start (excluding MRAM base address)
-const static uint32_t EVENT_FIFO_SIZE = 0; // elements in the event FIFO
-const static uint32_t EVENT_FIFO_WATERMARK = 0; // watermark level to generate interrupt
-
 // SPI burst settings. User adjustable.
 #define MAX_SPI_BURST_TX_MESSAGES  8 // Max CAN messages in a SPI write. A high value gives better TX throughput but can lead to lost rx messages due to blocking rx too long.
 #define MAX_SPI_BURST_RX_MESSAGES 32 // Max CAN messages in a SPI read
+#define RX_PIPELINE_DEPTH 2 // SPI rx reads in flight. The next burst is read while the previous one is decoded.
+#define MAX_RX_MSGS_PER_PASS (RX_PIPELINE_DEPTH * MAX_SPI_BURST_RX_MESSAGES) // Max CAN messages fetched from one chip per rx pass
 
 // Buffer configuration. User adjustable.
 #define TX_BUFFER_SIZE  (16 + 1) // size of tx-buffer used between Linux networking stack and SPI. One slot is reserved to be able to keep track of if queue is full
@@ -48,71 +63,24 @@ const static uint32_t EVENT_FIFO_WATERMARK = 0; // watermark level to generate i
 #define NAPI_BUDGET 64 // maximum number of messages that NAPI will request
 #define RX_BUFFER_SIZE  (64 + 1) // size of buffer to store messages from chip until fetched by NAPI. One slot is reserved to be able to keep track of if queue is full.
 
-// TCAN4550 Registers
-const static uint32_t DEVICE_ID1 = 0x0;
-const static uint32_t DEVICE_ID2 = 0x4;
-const static uint32_t STATUS = 0x0C;
-const static uint32_t SPI_MASK = 0x10;
-
-const static uint32_t MODES_OF_OPERATION = 0x0800;
-const static uint32_t INTERRUPT_FLAGS = 0x0820;
-const static uint32_t INTERRUPT_ENABLE = 0x0830;
-
-const static uint32_t TEST = 0x1010; // test register
-const static uint32_t CCCR = 0x1018; // cc control register
-const static uint32_t NBTP = 0x101C; // nominal bit timing & prescaler register
-const static uint32_t ECR = 0x1040; // error counter register
-const static uint32_t PSR = 0x1044; // protocol status register
-const static uint32_t IR = 0x1050; // interrupt register
-const static uint32_t IE = 0x1054; // interrupt enable
-const static uint32_t ILE = 0x105C; // interrupt line enable
-const static uint32_t RXF0C = 0x10A0; // rx FIFO 0 configuration
-const static uint32_t RXF0S = 0x10A4; // rx FIFO 0 status
-const static uint32_t RXF0A = 0x10A8; // rx FIFO 0 acknowledge
-const static uint32_t TXBC = 0x10C0; // tx buffer configuration
-const static uint32_t TXESC = 0x10C8; // tx buffer element size configuration
-const static uint32_t RXESC = 0x10BC; // rx buffer element size configuration
-const static uint32_t TXQFS = 0x10C4; // tx FIFO/queue status
-const static uint32_t TXBAR = 0x10D0; // tx buffer add request
-const static uint32_t TXEFC = 0x10F0; // tx event fifo configuration
-
-const static uint32_t TX_8_BYTES = 0; // tx message length
-const static uint32_t RX_8_BYTES = 0; // rx message length
-
-const static uint32_t RF0N = (0x1UL << 0); // rx fifo 0 new data
-const static uint32_t RF0LE = (0x1UL << 3); // rx fifo 0 message lost
-const static uint32_t TC = (0x1UL << 9); // transmission complete
-const static uint32_t TFE = (0x1UL << 11); // transmit fifo empty
-const static uint32_t TEFW = (0x1UL << 13); // event fifo watermark
-const static uint32_t EP = (0x1UL << 23); // error passive
-const static uint32_t EW = (0x1UL << 24); // error warning
-const static uint32_t BO = (0x1UL << 25); // bus off
-
-const static uint32_t INIT = (0x1UL << 0); // init
-const static uint32_t CCE = (0x1UL << 1); // configuration change enable
-const static uint32_t CSR = (0x1UL << 4); // clock stop request
-const static uint32_t MON = (0x1UL << 5); // bus monitoring mode
-const static uint32_t DAR = (0x1UL << 6); // disable automatic retransmission
-const static uint32_t TEST_EN = (0x1UL << 7); // test mode
-
-const static uint32_t MODESEL_1 = (0x1UL << 6);
-const static uint32_t MODESEL_2 = (0x1UL << 7);
-
-const static uint32_t LBCK = (0x1UL << 4); // loopback mode
-
-const static uint32_t ERROR_PASSIVE = (0x1UL << 5);
-const static uint32_t ERROR_WARNING = (0x1UL << 6);
-const static uint32_t BUS_OFF = (0x1UL << 7);
-
-const static uint32_t TCAN_EXTENDED_FLAG = (0x1UL << 30);
-
-// Message RAM (MRAM) constants. Do not change.
-const static uint32_t MRAM_BASE = 0x8000;
-const static uint32_t MRAM_SIZE_WORDS = 0x200;
-
-// Identifiers for TCAN4550 chip. TCAN4550 in ascii.
-const static uint32_t TCAN_ID = 0x4E414354;
-const static uint32_t TCAN_ID2 = 0x30353534;
+// Shared SPI bus settings. User adjustable.
+#define MAX_CHIPS_PER_BUS 8 // Max TCAN4550 chips (chip selects) on one SPI controller
+#define MAX_RX_ROUNDS 3 // Max round robin rx passes per chip in one interrupt service pass, each up to RX_PIPELINE_DEPTH bursts
+
+// PTP clock settings. User adjustable.
+#define TIMESTAMP_PRESCALER 1 // CAN bit times per timestamp counter tick (1 - 16). A higher value gives less frequent counter wraps but lower resolution.
+#define PTP_MAX_ADJ_PPB 100000 // max frequency adjustment of ptp clock
+
+// Health monitoring settings. User adjustable.
+#define HEALTH_CHECK_INTERVAL_MS 100 // interval of checks for chip reset or brown out
+
+// Tx latency statistics settings.
+#define TX_LAT_BUCKETS 32 // log2 histogram buckets, last bucket holds all latencies >= 2^30 ns
+#define TX_LAT_SLOTS 32 // max tx fifo size
+#define TX_LAT_EVENTS 32 // max tx event fifo size, read in one SPI burst
+
+// Rx rate limit settings. User adjustable.
+#define MAX_RX_RATE_LIMITS 16 // Max number of rx rate limits (single ids or id ranges) per interface
 
 // byte ordering for sending 32-bit transfers over SPI
 #ifdef MSB_LSB_SWAP
@@ -127,10 +95,18 @@ const static uint32_t TCAN_ID2 = 0x30353534;
 #define BYTE_3 3
 #endif
 
-const static uint32_t SPI_READ_COMMAND = 0x41;
-const static uint32_t SPI_WRITE_COMMAND = 0x61;
+// SPI words between which the chip latches a register value being read. The
+// SPI core takes system timestamps around these words for ptp cross
+// timestamps.
+#ifdef USE_32BIT_SPI_TRANSFERS
+#define SPI_STS_WORD_PRE 0
+#define SPI_STS_WORD_POST 1
+#else
+#define SPI_STS_WORD_PRE 3
+#define SPI_STS_WORD_POST 4
+#endif
 
-const static struct can_bittiming_const tcan4550_bittiming_const = {
+static const struct can_bittiming_const tcan4550_bittiming_const = {
 	.name = KBUILD_MODNAME,
 	.tseg1_min = 2,
 	.tseg1_max = 256,
@@ -146,78 +122,312 @@ struct tcan_raw {
 	uint32_t data[4];
 };
 
+// What to do with received msgs when rx buffers are full. Applied both to the
+// hw rx fifo and the sw rx buffer.
+enum tcan4550_overload_policy {
+	RX_OVERLOAD_DROP_NEWEST = 0, // hw fifo blocks, sw buffer drops new msgs
+	RX_OVERLOAD_DROP_OLDEST, // hw fifo overwrites (F0OM), sw buffer overwrites oldest msgs
+	RX_OVERLOAD_BACKPRESSURE, // msgs are left in hw fifo until sw buffer has room, only hw fifo drops new msgs
+};
+
+static const char * const tcan4550_overload_policy_names[] = {
+	[RX_OVERLOAD_DROP_NEWEST] = "drop-newest",
+	[RX_OVERLOAD_DROP_OLDEST] = "drop-oldest",
+	[RX_OVERLOAD_BACKPRESSURE] = "backpressure",
+};
+
+// Rx msgs dropped due to overload
+struct tcan4550_overload_stats {
+	uint64_t sw_dropped_newest; // new msgs dropped as sw rx buffer was full
+	uint64_t sw_dropped_oldest; // old msgs overwritten in sw rx buffer
+	uint64_t hw_lost; // message lost interrupts from hw rx fifo (blocking mode)
+	uint64_t hw_full; // hw rx fifo full interrupts, new msgs overwrite the oldest (overwrite mode)
+	uint64_t hw_overwritten; // msgs found overwritten in hw rx fifo when read (overwrite mode)
+	uint64_t backpressure_stalls; // times msgs were left in hw fifo as sw rx buffer was full
+};
+
+// Token bucket limiting the rate of received msgs with ids in [first, last]
+struct tcan4550_rate_limit {
+	canid_t first; // first id in range, including CAN_EFF_FLAG for extended ids
+	canid_t last; // last id in range, including CAN_EFF_FLAG for extended ids
+	uint32_t rate; // msgs per second
+	uint32_t burst; // bucket size in msgs
+	uint64_t tokens; // NSEC_PER_SEC tokens per msg
+	uint64_t last_ns; // time of last refill
+	uint64_t dropped; // msgs dropped by this limit
+	bool storm; // limit is currently dropping msgs
+};
+
+// Configuration registers written by tcan4550_init, used to restore the chip
+// quickly after a reset or brown out
+struct tcan4550_cfg_image {
+	uint32_t cccr;
+	uint32_t test;
+	uint32_t nbtp;
+	uint32_t tscc;
+	uint32_t txbc;
+	uint32_t rxf0c;
+	uint32_t txesc;
+	uint32_t rxesc;
+	uint32_t txefc;
+	uint32_t ie;
+	uint32_t ile;
+	uint32_t txbtie;
+};
+
+// Stages a tx msg passes and histogram classes of tx latency statistics
+enum tcan4550_tx_lat_stage {
+	TX_LAT_QUEUE = 0, // waiting in sw tx buffer
+	TX_LAT_SPI, // SPI write to hw tx fifo
+	TX_LAT_BUS, // waiting in hw tx fifo and bus arbitration
+	TX_LAT_TOTAL,
+	TX_LAT_STAGES
+};
+
+enum tcan4550_tx_lat_class {
+	TX_LAT_PRIO = 0, // id below tx_latency_prio_id
+	TX_LAT_OTHER,
+	TX_LAT_CLASSES
+};
+
+// Timestamps of the msg in one hw tx fifo slot
+struct tcan4550_tx_lat_slot {
+	uint64_t xmit_ns; // tcan_start_xmit, 0 for msgs from tx ring
+	uint64_t txbar_ns; // transmission requested
+	uint32_t cls;
+};
+
+// Tx latency statistics, protected by bus lock
+struct tcan4550_tx_lat {
+	bool enabled; // tx events stored and tx event fifo interrupt enabled, completion is measured
+	uint32_t prio_id; // msgs with lower id are counted in prio class
+	uint32_t pending; // hw tx fifo slots waiting for their tx event
+	struct tcan4550_tx_lat_slot slot[TX_LAT_SLOTS];
+	uint64_t hist[TX_LAT_CLASSES][TX_LAT_STAGES][TX_LAT_BUCKETS];
+};
+
+struct tcan4550_priv;
+
+// One interrupt line used by one or more chips on the same SPI bus
+struct tcan4550_irq_line {
+	int irq;
+	int users; // number of open chips using this line
+};
+
+// All chips connected to the same SPI controller share one bus coordinator.
+// Interrupts and tx work of all chips are serviced in turn by the
+// coordinator instead of each chip contending blindly for the controller.
+struct tcan4550_bus {
+	struct list_head list; // entry in tcan4550_buses
+	struct spi_controller *ctlr;
+	int refs; // number of probed chips on this bus
+
+	struct mutex lock; // serializes interrupt service, tx work and restarts on this bus
+	struct workqueue_struct *wq; // ordered work queue shared by all chips on this bus
+
+	struct tcan4550_priv *chips[MAX_CHIPS_PER_BUS]; // open chips, protected by lock
+	uint32_t next_chip; // round robin start position, protected by lock
+
+	struct tcan4550_irq_line irqs[MAX_CHIPS_PER_BUS]; // protected by tcan4550_buses_lock
+};
+
+// One pipelined rx SPI read: reads a burst of rx fifo elements and
+// acknowledges them in the same SPI message. Buffers written by the SPI
+// controller start on their own cache line so DMA does not clobber fields
+// written by the CPU.
+struct tcan4550_rx_burst {
+	unsigned char read_rxBuf[4 + (MAX_SPI_BURST_RX_MESSAGES * 16)] ____cacheline_aligned;
+	unsigned char ack_rxBuf[8] ____cacheline_aligned;
+	unsigned char read_txBuf[4 + (MAX_SPI_BURST_RX_MESSAGES * 16)] ____cacheline_aligned;
+	unsigned char ack_txBuf[8];
+	struct spi_transfer t[2];
+	struct spi_message m;
+	struct completion done;
+	uint32_t msgs; // msgs read by this burst
+	bool inFlight; // submitted and not yet waited for
+};
+
+// SPI scratch buffers. Allocated separately from tcan4550_priv so the large
+// buffers do not share cache lines with the ring indexes. Rx and tx event
+// buffers are used by the irq thread, tx buffers by the tx work.
+struct tcan4550_spi_bufs {
+	uint32_t rxBuffer[MAX_SPI_BURST_RX_MESSAGES * 4];
+	struct tcan4550_rx_burst rxBurst[RX_PIPELINE_DEPTH];
+
+	uint32_t eventBuffer[TX_LAT_EVENTS * 2];
+	unsigned char event_rxBuf[4 + (TX_LAT_EVENTS * 8)] ____cacheline_aligned;
+	unsigned char event_txBuf[4 + (TX_LAT_EVENTS * 8)] ____cacheline_aligned;
+
+	uint32_t txBuffer[MAX_SPI_BURST_TX_MESSAGES * 4] ____cacheline_aligned;
+	unsigned char write_txBuf[4 + (MAX_SPI_BURST_TX_MESSAGES * 16)];
+	unsigned char write_rxBuf[4 + (MAX_SPI_BURST_TX_MESSAGES * 16)];
+};
+
+// Private data is grouped in cache line aligned sections by writer so the irq
+// thread, tx work, NAPI and start_xmit running on different cores do not
+// bounce each others cache lines. Both sides of a sw buffer take its lock to
+// move the indexes, so the lock, indexes and buffer share one section.
 struct tcan4550_priv {
 	struct can_priv can; // must be located first in private struct
-	struct device *dev;
+
+	// read mostly, written only at probe, open, close and configuration
+	struct device *dev ____cacheline_aligned_in_smp;
 	struct net_device *ndev;
 	struct spi_device *spi;
-	struct gpio_desc *reset_gpio;
-
+	struct tcan4550_bus *bus;
 	struct workqueue_struct *wq;
-	struct work_struct tx_work;
-	struct work_struct restart_work;
-
-	struct sk_buff *tx_skb_buf[TX_BUFFER_SIZE];
+	struct tcan4550_spi_bufs *bufs; // SPI scratch buffers
+	struct tcan4550_txring *txring; // memory mapped tx ring shared with user space
+	enum tcan4550_overload_policy rx_overload_policy; // changed only when interface is down
+	uint32_t rx_rate_limits_num;
+	bool chip_lost; // chip lost configuration and is not yet recovered
+	bool ptp_running; // timecounter is extending the counter
+
+	// tx sw buffer, shared by tcan_start_xmit and tx work. tcan_start_xmit
+	// queues tx work for every msg.
+	spinlock_t tx_skb_lock ____cacheline_aligned_in_smp; // spinlock protecting tx skb buffer
 	int tx_skb_buf_head;
 	int tx_skb_buf_tail;
+	struct work_struct tx_work;
+	struct sk_buff *tx_skb_buf[TX_BUFFER_SIZE];
+	uint64_t tx_skb_ts[TX_BUFFER_SIZE]; // time msg was queued in tcan_start_xmit
 
-	struct tcan_raw rx_skb_buf[RX_BUFFER_SIZE];
-	int rx_skb_buf_head;
-	int rx_skb_buf_tail;
+	// tx work
+	uint32_t txring_consumer ____cacheline_aligned_in_smp; // driver copy of consumer index, user space might overwrite the ring
 
-	uint32_t rxBuffer[MAX_SPI_BURST_RX_MESSAGES * 4];
-	uint32_t txBuffer[MAX_SPI_BURST_TX_MESSAGES * 4];
+	// tx latency, written by tx work and irq thread under bus lock
+	struct tcan4550_tx_lat tx_lat ____cacheline_aligned_in_smp;
 
-	unsigned char read_txBuf[4 + (MAX_SPI_BURST_RX_MESSAGES * 16)];
-	unsigned char read_rxBuf[4 + (MAX_SPI_BURST_RX_MESSAGES * 16)];
+	// rx, irq thread
+	struct tcan4550_overload_stats rx_overload_stats ____cacheline_aligned_in_smp;
+	spinlock_t rx_rate_lock; // spinlock protecting rx rate limits, only contended by sysfs
+	struct tcan4550_rate_limit rx_rate_limits[MAX_RX_RATE_LIMITS];
 
-	unsigned char write_txBuf[4 + (MAX_SPI_BURST_TX_MESSAGES * 16)];
-	unsigned char write_rxBuf[4 + (MAX_SPI_BURST_TX_MESSAGES * 16)];
+	// NAPI. The napi state is also set by napi_schedule in the irq thread.
+	struct napi_struct napi ____cacheline_aligned_in_smp;
+
+	// rx sw buffer, shared by irq thread and NAPI
+	spinlock_t rx_skb_lock ____cacheline_aligned_in_smp; // spinlock protecting rx skb buffer
+	int rx_skb_buf_head;
+	int rx_skb_buf_tail;
+	bool rx_stalled; // msgs left in hw fifo as sw rx buffer was full, protected by rx_skb_lock
+	struct tcan_raw rx_skb_buf[RX_BUFFER_SIZE];
 
-	spinlock_t tx_skb_lock; // spinlock protecting tx skb buffer
-	spinlock_t rx_skb_lock; // spinlock protecting rx skb buffer
-	struct mutex spi_lock; // mutex protecting SPI access
+	// SPI access, shared by irq thread, tx work and slow paths
+	struct mutex spi_lock ____cacheline_aligned_in_smp; // mutex protecting SPI access
 
-	struct napi_struct napi;
+	// cold, configuration and slow paths
+	struct gpio_desc *reset_gpio ____cacheline_aligned_in_smp;
+	struct work_struct restart_work;
+	struct work_struct rx_work;
+	struct delayed_work health_work;
+
+	struct tcan4550_cfg_image cfg_image;
+	uint64_t health_last_good_ns; // time of last successful health check
+	uint32_t health_recoveries;
+	uint64_t health_last_outage_ns;
+	uint64_t health_max_outage_ns;
+	bool health_pwron; // power on flag seen and cleared by interrupt handler, protected by bus lock
+
+	struct dentry *debugfs;
+
+	wait_queue_head_t txring_wait; // woken when consumer index is incremented
+	struct miscdevice txring_misc;
+	struct mutex txring_lock; // protects txring_gone against the file operations
+	bool txring_gone; // device removed, open files only hold a reference to priv
+
+	struct ptp_clock *ptp_clock;
+	struct ptp_clock_info ptp_info;
+	struct cyclecounter ptp_cc;
+	struct timecounter ptp_tc;
+	uint32_t ptp_base_mult; // cyclecounter mult without frequency adjustment
+	long ptp_scaled_ppm; // current frequency adjustment
+	uint64_t ptp_latched; // counter value returned by cyclecounter read
+	long ptp_update_jiffies; // timecounter update interval
+	uint64_t ptp_last_sys_ns; // system time of last timecounter update
+	spinlock_t ptp_lock; // spinlock protecting timecounter and cyclecounter
+	struct mutex ptp_mutex; // mutex serializing counter reads and timecounter updates
 };
 
 // SPI helper function headers
 static int spi_transfer(struct spi_device *spi, int lenBytes,
 			unsigned char *rxBuf, unsigned char *txBuf);
+static int spi_transfer_sts(struct spi_device *spi, int lenBytes,
+			    unsigned char *rxBuf, unsigned char *txBuf,
+			    struct ptp_system_timestamp *sts);
 static uint32_t spi_read32(struct spi_device *spi, uint32_t address);
+static uint32_t spi_read32_sts(struct spi_device *spi, uint32_t address,
+			       struct ptp_system_timestamp *sts);
 static int spi_write32(struct spi_device *spi, uint32_t address, uint32_t data);
 static int spi_write_msgs(struct tcan4550_priv *priv, uint32_t address,
 			  int32_t msgs, uint32_t *data);
-static int spi_read_msgs(struct tcan4550_priv *priv, uint32_t address,
-			 int32_t msgs, uint32_t *data);
+static int spi_read_events(struct tcan4550_priv *priv, uint32_t address,
+			   uint32_t events, uint32_t *data);
+static int spi_read_msgs_submit(struct tcan4550_priv *priv,
+				struct tcan4550_rx_burst *burst,
+				uint32_t address, uint32_t msgs, bool acknowledge,
+				uint32_t ack);
+static int spi_read_msgs_wait(struct tcan4550_rx_burst *burst);
+static void spi_read_msgs_unpack(struct tcan4550_rx_burst *burst,
+				 uint32_t *data);
 
 // TCAN function headers
 static void tcan4550_init(struct net_device *dev);
 static void tcan4550_set_normal_mode(struct spi_device *spi);
 static void tcan4550_set_standby_mode(struct spi_device *spi);
-static void tcan4550_configure_mram(struct spi_device *spi);
+static void tcan4550_configure_mram(struct spi_device *spi, bool rxOverwrite);
+static void tcan4550_clear_mram(struct spi_device *spi);
 static void tcan4550_clear_sw_buffers(struct tcan4550_priv *priv);
 static void tcan4550_unlock(struct spi_device *spi);
 static bool tcan4550_read_identification(struct spi_device *spi);
 static void tcan4550_set_bit_rate(struct spi_device *spi, uint32_t bitRateReg);
-static void tcan4550_setup_interrupts(struct spi_device *spi);
+static void tcan4550_configure_timestamps(struct spi_device *spi);
+static void tcan4550_setup_interrupts(struct spi_device *spi, bool rxOverwrite);
 static void tcan4550_hw_reset(struct net_device *dev);
 static void tcan4550_setup_io(struct net_device *dev);
 static void tcan4550_skbuff_to_tcan_msg(struct sk_buff *skb, uint32_t *buffer);
 static int tcan4550_set_mode(struct net_device *net, enum can_mode mode);
 static void tcan4550_configure_control_modes(struct net_device *dev);
 static void tcan4550_handle_bus_status_change(void *dev);
-static irqreturn_t tcan4550_handle_interrupts(int irq, void *dev);
+static void tcan4550_handle_events(struct tcan4550_priv *priv, uint32_t ir);
+static irqreturn_t tcan4550_handle_interrupts(int irq, void *data);
 static void tcan4550_tx_work_handler(struct work_struct *ws);
 static void tcan4550_send_msgs(struct tcan4550_priv *priv);
+static void tcan4550_send_ring_msgs(struct tcan4550_priv *priv);
 static uint32_t tcan4550_rec_msgs(struct net_device *dev);
 static int tcan4550_poll(struct napi_struct *napi, int budget);
+static bool tcan4550_rx_rate_ok(struct tcan4550_priv *priv, uint32_t t0);
+static bool tcan4550_ptp_rx_time(struct tcan4550_priv *priv, uint32_t raw,
+				 uint64_t *ns);
+static bool tcan4550_ptp_sys_time(struct tcan4550_priv *priv, uint32_t raw,
+				  uint64_t *ns);
+static void tcan4550_ptp_resync(struct tcan4550_priv *priv);
+
+// Chip health function headers
+static void tcan4550_save_cfg_image(struct tcan4550_priv *priv);
+static void tcan4550_health_work_handler(struct work_struct *ws);
+static void tcan4550_health_kick(struct tcan4550_priv *priv);
+
+// SPI bus coordinator function headers
+static struct tcan4550_bus *tcan4550_bus_get(struct spi_device *spi);
+static void tcan4550_bus_put(struct tcan4550_bus *bus);
+static int tcan4550_bus_attach(struct tcan4550_priv *priv);
+static void tcan4550_bus_detach(struct tcan4550_priv *priv);
 
 /*------------------------------------------------------------*/
 /* SPI helper functions                                       */
 /*------------------------------------------------------------*/
 static int spi_transfer(struct spi_device *spi, int lenBytes,
 			unsigned char *rxBuf, unsigned char *txBuf)
+{
+	return spi_transfer_sts(spi, lenBytes, rxBuf, txBuf, NULL);
+}
+
+// SPI transfer, optionally taking system timestamps (sts) around the SPI
+// words where the chip latches the register being read
+static int spi_transfer_sts(struct spi_device *spi, int lenBytes,
+			    unsigned char *rxBuf, unsigned char *txBuf,
+			    struct ptp_system_timestamp *sts)
 {
 	struct net_device *ndev = spi_get_drvdata(spi);
 	struct tcan4550_priv *priv = netdev_priv(ndev);
@@ -226,6 +436,9 @@ static int spi_transfer(struct spi_device *spi, int lenBytes,
 		.rx_buf = rxBuf,
 		.len = lenBytes,
 		.cs_change = 0,
+		.ptp_sts = sts,
+		.ptp_sts_word_pre = SPI_STS_WORD_PRE,
+		.ptp_sts_word_post = SPI_STS_WORD_POST,
 	};
 
 	struct spi_message m;
@@ -252,6 +465,12 @@ static int spi_transfer(struct spi_device *spi, int lenBytes,
 }
 
 static uint32_t spi_read32(struct spi_device *spi, uint32_t address)
+{
+	return spi_read32_sts(spi, address, NULL);
+}
+
+static uint32_t spi_read32_sts(struct spi_device *spi, uint32_t address,
+			       struct ptp_system_timestamp *sts)
 {
 	unsigned char txBuf[8];
 	unsigned char rxBuf[8];
@@ -261,45 +480,139 @@ static uint32_t spi_read32(struct spi_device *spi, uint32_t address)
 	txBuf[BYTE_2] = address & 0xFF;
 	txBuf[BYTE_3] = 1;
 
-	spi_transfer(spi, 8, rxBuf, txBuf);
+	spi_transfer_sts(spi, 8, rxBuf, txBuf, sts);
 
 	return (rxBuf[4 + BYTE_0] << 24) + (rxBuf[4 + BYTE_1] << 16) +
 		   (rxBuf[4 + BYTE_2] << 8) + rxBuf[4 + BYTE_3];
 }
 
-static int spi_read_msgs(struct tcan4550_priv *priv, uint32_t address,
-			 int32_t msgs, uint32_t *data)
+// read events tx event fifo elements at address in one SPI burst
+static int spi_read_events(struct tcan4550_priv *priv, uint32_t address,
+			   uint32_t events, uint32_t *data)
+{
+	unsigned char *rxBuf = priv->bufs->event_rxBuf;
+	uint32_t i;
+	int ret;
+
+	if (events > TX_LAT_EVENTS) {
+		return -EINVAL;
+	}
+
+	priv->bufs->event_txBuf[BYTE_0] = SPI_READ_COMMAND;
+	priv->bufs->event_txBuf[BYTE_1] = address >> 8;
+	priv->bufs->event_txBuf[BYTE_2] = address & 0xFF;
+	priv->bufs->event_txBuf[BYTE_3] = events * 2;
+
+	ret = spi_transfer(priv->spi, 4 + (events * 8), rxBuf,
+			   priv->bufs->event_txBuf);
+	if (ret) {
+		return ret;
+	}
+
+	for (i = 0; i < (events * 2); i++) {
+		data[i] = rxBuf[4 + BYTE_3 + (i * 4)] +
+			  (rxBuf[4 + BYTE_2 + (i * 4)] << 8) +
+			  (rxBuf[4 + BYTE_1 + (i * 4)] << 16) +
+			  (rxBuf[4 + BYTE_0 + (i * 4)] << 24);
+	}
+
+	return 0;
+}
+
+static void spi_read_msgs_complete(void *context)
+{
+	complete(context);
+}
+
+// start an asynchronous read of msgs rx fifo elements at address, followed by
+// an acknowledge of rx fifo index ack if acknowledge is set. Caller must hold
+// spi_lock until the burst has been waited for, messages are executed in
+// submission order.
+static int spi_read_msgs_submit(struct tcan4550_priv *priv,
+				struct tcan4550_rx_burst *burst,
+				uint32_t address, uint32_t msgs, bool acknowledge,
+				uint32_t ack)
 {
-	uint32_t i, j;
 	int ret;
 
+	burst->inFlight = false;
+
 	if (msgs > MAX_SPI_BURST_RX_MESSAGES) {
 		return -EINVAL;
 	}
 
-	priv->read_txBuf[BYTE_0] = SPI_READ_COMMAND;
-	priv->read_txBuf[BYTE_1] = address >> 8;
-	priv->read_txBuf[BYTE_2] = address & 0xFF;
-	priv->read_txBuf[BYTE_3] = msgs * 4;
+	burst->read_txBuf[BYTE_0] = SPI_READ_COMMAND;
+	burst->read_txBuf[BYTE_1] = address >> 8;
+	burst->read_txBuf[BYTE_2] = address & 0xFF;
+	burst->read_txBuf[BYTE_3] = msgs * 4;
+
+	burst->ack_txBuf[BYTE_0] = SPI_WRITE_COMMAND;
+	burst->ack_txBuf[BYTE_1] = RXF0A >> 8;
+	burst->ack_txBuf[BYTE_2] = RXF0A & 0xFF;
+	burst->ack_txBuf[BYTE_3] = 1;
+	burst->ack_txBuf[4 + BYTE_0] = (ack >> 24) & 0xFF;
+	burst->ack_txBuf[4 + BYTE_1] = (ack >> 16) & 0xFF;
+	burst->ack_txBuf[4 + BYTE_2] = (ack >> 8) & 0xFF;
+	burst->ack_txBuf[4 + BYTE_3] = ack & 0xFF;
+
+	memset(burst->t, 0, sizeof(burst->t));
+	burst->t[0].tx_buf = burst->read_txBuf;
+	burst->t[0].rx_buf = burst->read_rxBuf;
+	burst->t[0].len = 4 + (msgs * 16);
+	burst->t[0].cs_change = acknowledge; // end SPI command before the acknowledge
+	burst->t[1].tx_buf = burst->ack_txBuf;
+	burst->t[1].rx_buf = burst->ack_rxBuf;
+	burst->t[1].len = 8;
+
+	spi_message_init(&burst->m);
+	spi_message_add_tail(&burst->t[0], &burst->m);
+	if (acknowledge) {
+		spi_message_add_tail(&burst->t[1], &burst->m);
+	}
+	burst->m.complete = spi_read_msgs_complete;
+	burst->m.context = &burst->done;
 
-	ret = spi_transfer(priv->spi, 4 + (msgs * 16), priv->read_rxBuf,
-			   priv->read_txBuf);
+	reinit_completion(&burst->done);
+	burst->msgs = msgs;
 
-	for (i = 0; i < msgs; i++) {
+	ret = spi_async(priv->spi, &burst->m);
+	if (ret) {
+		dev_err(priv->dev, "spi_async failed: ret = %d\n", ret);
+	} else {
+		burst->inFlight = true;
+	}
+
+	return ret;
+}
+
+// wait for a burst started by spi_read_msgs_submit
+static int spi_read_msgs_wait(struct tcan4550_rx_burst *burst)
+{
+	if (!burst->inFlight) {
+		return -EIO;
+	}
+
+	wait_for_completion(&burst->done);
+	burst->inFlight = false;
+
+	return burst->m.status;
+}
+
+// unpack the elements of a successfully waited for burst
+static void spi_read_msgs_unpack(struct tcan4550_rx_burst *burst,
+				 uint32_t *data)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < burst->msgs; i++) {
 		for (j = 0; j < 4; j++) {
 			data[j + (i * 4)] =
-				priv->read_rxBuf[4 + BYTE_3 + (j * 4) +
-						 (i * 16)] +
-				(priv->read_rxBuf[4 + BYTE_2 + (j * 4) +
-						  (i * 16)] << 8) +
-				(priv->read_rxBuf[4 + BYTE_1 + (j * 4) +
-						  (i * 16)] << 16) +
-				(priv->read_rxBuf[4 + BYTE_0 + (j * 4) +
-						  (i * 16)] << 24);
+				burst->read_rxBuf[4 + BYTE_3 + (j * 4) + (i * 16)] +
+				(burst->read_rxBuf[4 + BYTE_2 + (j * 4) + (i * 16)] << 8) +
+				(burst->read_rxBuf[4 + BYTE_1 + (j * 4) + (i * 16)] << 16) +
+				(burst->read_rxBuf[4 + BYTE_0 + (j * 4) + (i * 16)] << 24);
 		}
 	}
-
-	return ret;
 }
 
 static int spi_write32(struct spi_device *spi, uint32_t address, uint32_t data)
@@ -333,24 +646,24 @@ static int spi_write_msgs(struct tcan4550_priv *priv, uint32_t address,
 		return -EINVAL;
 	}
 
-	priv->write_txBuf[BYTE_0] = SPI_WRITE_COMMAND;
-	priv->write_txBuf[BYTE_1] = address >> 8;
-	priv->write_txBuf[BYTE_2] = address & 0xFF;
-	priv->write_txBuf[BYTE_3] = msgs * 4;
+	priv->bufs->write_txBuf[BYTE_0] = SPI_WRITE_COMMAND;
+	priv->bufs->write_txBuf[BYTE_1] = address >> 8;
+	priv->bufs->write_txBuf[BYTE_2] = address & 0xFF;
+	priv->bufs->write_txBuf[BYTE_3] = msgs * 4;
 
 	for (i = 0; i < (msgs * 4); i++) {
-		priv->write_txBuf[4 + BYTE_0 + (i * 4)] =
+		priv->bufs->write_txBuf[4 + BYTE_0 + (i * 4)] =
 			((data[i] >> 24) & 0xFF);
-		priv->write_txBuf[4 + BYTE_1 + (i * 4)] =
+		priv->bufs->write_txBuf[4 + BYTE_1 + (i * 4)] =
 			((data[i] >> 16) & 0xFF);
-		priv->write_txBuf[4 + BYTE_2 + (i * 4)] =
+		priv->bufs->write_txBuf[4 + BYTE_2 + (i * 4)] =
 			((data[i] >> 8) & 0xFF);
-		priv->write_txBuf[4 + BYTE_3 + (i * 4)] =
+		priv->bufs->write_txBuf[4 + BYTE_3 + (i * 4)] =
 			(data[i] & 0xFF);
 	}
 
-	ret = spi_transfer(priv->spi, 4 + (msgs * 16), priv->write_rxBuf,
-			   priv->write_txBuf);
+	ret = spi_transfer(priv->spi, 4 + (msgs * 16), priv->bufs->write_rxBuf,
+			   priv->bufs->write_txBuf);
 
 	return ret;
 }
@@ -364,10 +677,7 @@ static void tcan4550_set_standby_mode(struct spi_device *spi)
 
 	val = spi_read32(spi, MODES_OF_OPERATION);
 
-	val |= MODESEL_1;
-	val &= ~((uint32_t)MODESEL_2);
-
-	spi_write32(spi, MODES_OF_OPERATION, val);
+	spi_write32(spi, MODES_OF_OPERATION, tcan4550_modes_standby(val));
 }
 
 static void tcan4550_set_normal_mode(struct spi_device *spi)
@@ -376,10 +686,7 @@ static void tcan4550_set_normal_mode(struct spi_device *spi)
 
 	val = spi_read32(spi, MODES_OF_OPERATION);
 
-	val |= MODESEL_2;
-	val &= ~((uint32_t)MODESEL_1);
-
-	spi_write32(spi, MODES_OF_OPERATION, val);
+	spi_write32(spi, MODES_OF_OPERATION, tcan4550_modes_normal(val));
 }
 
 static bool tcan4550_read_identification(struct spi_device *spi)
@@ -402,20 +709,35 @@ static void tcan4550_set_bit_rate(struct spi_device *spi, uint32_t bitRateReg)
 	spi_write32(spi, NBTP, bitRateReg);
 }
 
-static void tcan4550_configure_mram(struct spi_device *spi)
+// timestamp counter counts CAN bit times, used as ptp clock and for rx timestamps
+static void tcan4550_configure_timestamps(struct spi_device *spi)
+{
+	spi_write32(spi, TSCC, tcan4550_tscc(TIMESTAMP_PRESCALER));
+}
+
+// clear MRAM to avoid risk of ECC errors 2kB = 512 words. Written in SPI
+// bursts of the size of a tx burst instead of one word at a time.
+static void tcan4550_clear_mram(struct spi_device *spi)
 {
+	struct tcan4550_priv *priv = netdev_priv(spi_get_drvdata(spi));
+	uint32_t zeros[MAX_SPI_BURST_TX_MESSAGES * 4] = { 0 };
 	uint32_t i;
 
-	// clear MRAM to avoid risk of ECC errors 2kB = 512 words
-	for (i = 0; i < MRAM_SIZE_WORDS; i++) {
-		spi_write32(spi, MRAM_BASE + (i * 4), 0);
+	for (i = 0; i < MRAM_SIZE_WORDS; i += MAX_SPI_BURST_TX_MESSAGES * 4) {
+		spi_write_msgs(priv, MRAM_BASE + (i * 4),
+			       MAX_SPI_BURST_TX_MESSAGES, zeros);
 	}
+}
+
+static void tcan4550_configure_mram(struct spi_device *spi, bool rxOverwrite)
+{
+	tcan4550_clear_mram(spi);
 
 	// configure tx-fifo
-	spi_write32(spi, TXBC, TX_FIFO_START_ADDRESS + (TX_FIFO_SIZE << 24));
+	spi_write32(spi, TXBC, tcan4550_txbc());
 
 	// configure rx-fifo
-	spi_write32(spi, RXF0C, RX_FIFO_START_ADDRESS + (RX_FIFO_SIZE << 16));
+	spi_write32(spi, RXF0C, tcan4550_rxf0c(rxOverwrite));
 
 	// size of one tx message
 	spi_write32(spi, TXESC, TX_8_BYTES);
@@ -424,19 +746,14 @@ static void tcan4550_configure_mram(struct spi_device *spi)
 	spi_write32(spi, RXESC, RX_8_BYTES);
 
 	// setup tx event-fifo
-	spi_write32(spi, TXEFC,
-			EVENT_FIFO_START_ADDRESS + (EVENT_FIFO_SIZE << 16) +
-				(EVENT_FIFO_WATERMARK << 24));
+	spi_write32(spi, TXEFC, tcan4550_txefc());
 }
 
 static void tcan4550_unlock(struct spi_device *spi)
 {
 	uint32_t val = spi_read32(spi, CCCR);
 
-	val |= (CCE + INIT); // set CCE and INIT bits
-	val &= ~((uint32_t)CSR); // clear CSR
-
-	spi_write32(spi, CCCR, val);
+	spi_write32(spi, CCCR, tcan4550_cccr_unlock(val));
 }
 
 static void tcan4550_clear_sw_buffers(struct tcan4550_priv *priv)
@@ -456,32 +773,269 @@ static void tcan4550_clear_sw_buffers(struct tcan4550_priv *priv)
 	spin_lock_irqsave(&priv->rx_skb_lock, flags);
 	priv->rx_skb_buf_head = 0;
 	priv->rx_skb_buf_tail = 0;
+	priv->rx_stalled = false;
 	spin_unlock_irqrestore(&priv->rx_skb_lock, flags);
 }
 
 // convert a struct sk_buff (socket buffer) to a tcan4550 msg and store in buffer
 void tcan4550_skbuff_to_tcan_msg(struct sk_buff *skb, uint32_t *buffer)
 {
-	struct can_frame *frame = (struct can_frame *)skb->data;
-	bool extended = (frame->can_id & CAN_EFF_FLAG) ? true : false;
-	bool rtr = (frame->can_id & CAN_RTR_FLAG) ? true : false;
-	uint32_t len = (frame->len <= 8) ? frame->len : 8;
-	uint32_t id;
+	tcan4550_can_frame_to_tcan_msg((struct can_frame *)skb->data, buffer);
+}
 
-	if (extended) {
-		id = frame->can_id & CAN_EFF_MASK;
-		buffer[0] = id + (rtr << 29) +
-				TCAN_EXTENDED_FLAG; // add extended + rtr flag
-	} else {
-		id = frame->can_id & CAN_SFF_MASK;
-		buffer[0] = (id << 18) + (rtr << 29); // add rtr flag
+/*------------------------------------------------------------*/
+/* Tx latency functions                                       */
+/*------------------------------------------------------------*/
+
+static struct dentry *tcan4550_debugfs_root;
+
+static const char * const tcan4550_tx_lat_stage_names[TX_LAT_STAGES] = {
+	[TX_LAT_QUEUE] = "queue (start_xmit to SPI write)",
+	[TX_LAT_SPI] = "spi (SPI write to TXBAR)",
+	[TX_LAT_BUS] = "bus (TXBAR to transmission complete)",
+	[TX_LAT_TOTAL] = "total (start_xmit to transmission complete)",
+};
+
+static const char * const tcan4550_tx_lat_class_names[TX_LAT_CLASSES] = {
+	[TX_LAT_PRIO] = "prio",
+	[TX_LAT_OTHER] = "other",
+};
+
+// msgs with id below prio_id are counted separately
+static uint32_t tcan4550_tx_lat_class(struct tcan4550_priv *priv, canid_t id)
+{
+	return ((id & CAN_EFF_MASK) < priv->tx_lat.prio_id) ? TX_LAT_PRIO : TX_LAT_OTHER;
+}
+
+// add latency to log2 histogram, bucket n holds latencies in [2^(n-1), 2^n) ns
+static void tcan4550_tx_lat_add(struct tcan4550_priv *priv, uint32_t cls,
+				uint32_t stage, uint64_t from, uint64_t to)
+{
+	uint32_t bucket;
+
+	// no start time (msg from tx ring has no start_xmit time)
+	if ((from == 0) || (to < from)) {
+		return;
+	}
+
+	bucket = min_t(uint32_t, fls64(to - from), TX_LAT_BUCKETS - 1);
+	priv->tx_lat.hist[cls][stage][bucket]++;
+}
+
+// transmission of tx fifo slots [firstSlot, firstSlot + msgs) has been
+// requested with TXBAR, SPI write of the msgs started at spiNs
+static void tcan4550_tx_lat_requested(struct tcan4550_priv *priv,
+				      uint32_t firstSlot, uint32_t msgs,
+				      uint64_t spiNs)
+{
+	uint64_t now = ktime_get_ns();
+	uint32_t i;
+
+	for (i = firstSlot; i < (firstSlot + msgs); i++) {
+		struct tcan4550_tx_lat_slot *slot = &priv->tx_lat.slot[i];
+
+		slot->txbar_ns = now;
+
+		tcan4550_tx_lat_add(priv, slot->cls, TX_LAT_QUEUE, slot->xmit_ns, spiNs);
+		tcan4550_tx_lat_add(priv, slot->cls, TX_LAT_SPI, spiNs, now);
+
+		if (priv->tx_lat.enabled) {
+			priv->tx_lat.pending |= (1UL << i);
+		}
+	}
+}
+
+// tx event fifo new entry. A tx event holds the timestamp counter value at
+// the start of frame and the tx fifo slot as message marker. The completion
+// time is the start of frame plus the frame time without stuff bits, so it
+// does not include the interrupt latency. All events are read in one SPI
+// burst, two when the event fifo wraps around.
+static void tcan4550_tx_lat_complete(struct tcan4550_priv *priv)
+{
+	uint32_t txefs = spi_read32(priv->spi, TXEFS);
+	uint32_t events = tcan4550_txefs_fill_level(txefs);
+	uint32_t getIndex = tcan4550_txefs_get_index(txefs);
+	uint32_t bitrate = priv->can.bittiming.bitrate;
+	uint32_t *e = priv->bufs->eventBuffer;
+	uint32_t first = min_t(uint32_t, events, EVENT_FIFO_SIZE - getIndex);
+	uint64_t now = ktime_get_ns();
+	uint32_t i;
+
+	if (events == 0) {
+		return;
+	}
+
+	if ((spi_read_events(priv, tcan4550_event_elem_address(getIndex), first,
+			     e) != 0) ||
+	    ((events > first) &&
+	     (spi_read_events(priv, tcan4550_event_elem_address(0),
+			      events - first, &e[first * 2]) != 0))) {
+		dev_err(priv->dev, "spi_read_events failed\n");
+		tcan4550_health_kick(priv);
+		return;
+	}
+
+	for (i = 0; i < events; i++) {
+		uint32_t e0 = e[i * 2];
+		uint32_t e1 = e[(i * 2) + 1];
+		uint32_t index = tcan4550_tx_event_mm(e1);
+		struct tcan4550_tx_lat_slot *slot;
+		uint64_t doneNs;
+
+		if ((index >= TX_LAT_SLOTS) ||
+		    !(priv->tx_lat.pending & (1UL << index))) {
+			continue;
+		}
+
+		// without ptp clock the counter cannot be related to system
+		// time, use the time the event is read
+		if (tcan4550_ptp_sys_time(priv, tcan4550_tx_event_timestamp(e1),
+					  &doneNs) && (bitrate > 0)) {
+			doneNs += div_u64((uint64_t)tcan4550_tx_event_frame_bits(e0, e1) *
+					  NSEC_PER_SEC, bitrate);
+		} else {
+			doneNs = now;
+		}
+
+		slot = &priv->tx_lat.slot[index];
+		tcan4550_tx_lat_add(priv, slot->cls, TX_LAT_BUS, slot->txbar_ns, doneNs);
+		tcan4550_tx_lat_add(priv, slot->cls, TX_LAT_TOTAL, slot->xmit_ns, doneNs);
+
+		priv->tx_lat.pending &= ~(1UL << index);
+	}
+
+	// acknowledge the last event, that frees all events up until that event
+	spi_write32(priv->spi, TXEFA, (getIndex + events - 1) % EVENT_FIFO_SIZE);
+}
+
+// completion of a transmission is only measured when enabled, as it costs a
+// tx event fifo interrupt per msg. Events left from an earlier measurement
+// are discarded.
+static void tcan4550_tx_lat_setup_interrupts(struct tcan4550_priv *priv)
+{
+	uint32_t ie = spi_read32(priv->spi, IE);
+	uint32_t txefs = spi_read32(priv->spi, TXEFS);
+	uint32_t events = tcan4550_txefs_fill_level(txefs);
+
+	ie = priv->tx_lat.enabled ? (ie | TEFN) : (ie & ~TEFN);
+
+	spi_write32(priv->spi, IE, ie);
+
+	if (events > 0) {
+		spi_write32(priv->spi, TXEFA,
+			    (tcan4550_txefs_get_index(txefs) + events - 1) % EVENT_FIFO_SIZE);
+	}
+
+	priv->tx_lat.pending = 0;
+}
+
+static int tcan4550_tx_lat_show(struct seq_file *m, void *v)
+{
+	struct tcan4550_priv *priv = m->private;
+	uint32_t cls, stage, bucket;
+
+	mutex_lock(&priv->bus->lock);
+
+	seq_printf(m, "completion measured: %s\n",
+		   priv->tx_lat.enabled ? "yes" : "no (see tx_latency_enable)");
+	seq_printf(m, "prio: id < 0x%x\n", priv->tx_lat.prio_id);
+
+	for (cls = 0; cls < TX_LAT_CLASSES; cls++) {
+		for (stage = 0; stage < TX_LAT_STAGES; stage++) {
+			seq_printf(m, "\n%s %s\n", tcan4550_tx_lat_class_names[cls],
+				   tcan4550_tx_lat_stage_names[stage]);
+
+			for (bucket = 0; bucket < TX_LAT_BUCKETS; bucket++) {
+				uint64_t count = priv->tx_lat.hist[cls][stage][bucket];
+
+				if (count == 0) {
+					continue;
+				}
+
+				// last bucket has no upper bound
+				if (bucket == (TX_LAT_BUCKETS - 1)) {
+					seq_printf(m, "  >= 2^%u ns: %llu\n",
+						   bucket - 1, count);
+					continue;
+				}
+
+				seq_printf(m, "  %10llu - %10llu ns: %llu\n",
+					   bucket ? (1ULL << (bucket - 1)) : 0ULL,
+					   (1ULL << bucket) - 1, count);
+			}
+		}
+	}
+
+	mutex_unlock(&priv->bus->lock);
+
+	return 0;
+}
+
+static int tcan4550_tx_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tcan4550_tx_lat_show, inode->i_private);
+}
+
+// any write clears the histograms
+static ssize_t tcan4550_tx_lat_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct tcan4550_priv *priv = ((struct seq_file *)file->private_data)->private;
+
+	mutex_lock(&priv->bus->lock);
+	memset(priv->tx_lat.hist, 0, sizeof(priv->tx_lat.hist));
+	mutex_unlock(&priv->bus->lock);
+
+	return count;
+}
+
+static const struct file_operations tcan4550_tx_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = tcan4550_tx_lat_open,
+	.read = seq_read,
+	.write = tcan4550_tx_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int tcan4550_tx_lat_enable_get(void *data, u64 *val)
+{
+	struct tcan4550_priv *priv = data;
+
+	*val = priv->tx_lat.enabled;
+
+	return 0;
+}
+
+static int tcan4550_tx_lat_enable_set(void *data, u64 val)
+{
+	struct tcan4550_priv *priv = data;
+
+	mutex_lock(&priv->bus->lock);
+
+	priv->tx_lat.enabled = !!val;
+	if (netif_running(priv->ndev) && !priv->chip_lost) {
+		tcan4550_tx_lat_setup_interrupts(priv);
+		priv->cfg_image.ie = spi_read32(priv->spi, IE);
 	}
 
-	buffer[1] = (len << 16);
-	buffer[2] = frame->data[0] + (frame->data[1] << 8) +
-			(frame->data[2] << 16) + (frame->data[3] << 24);
-	buffer[3] = frame->data[4] + (frame->data[5] << 8) +
-			(frame->data[6] << 16) + (frame->data[7] << 24);
+	mutex_unlock(&priv->bus->lock);
+
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(tcan4550_tx_lat_enable_fops, tcan4550_tx_lat_enable_get,
+			 tcan4550_tx_lat_enable_set, "%llu\n");
+
+static void tcan4550_debugfs_init(struct tcan4550_priv *priv)
+{
+	priv->debugfs = debugfs_create_dir(dev_name(priv->dev), tcan4550_debugfs_root);
+
+	debugfs_create_file("tx_latency", 0644, priv->debugfs, priv,
+			    &tcan4550_tx_lat_fops);
+	debugfs_create_file_unsafe("tx_latency_enable", 0644, priv->debugfs, priv,
+				   &tcan4550_tx_lat_enable_fops);
+	debugfs_create_x32("tx_latency_prio_id", 0644, priv->debugfs,
+			   &priv->tx_lat.prio_id);
 }
 
 // called from work queue
@@ -494,8 +1048,20 @@ static void tcan4550_tx_work_handler(struct work_struct *ws)
 	// from tcan_start_xmit (in that case no new item will be put on the queue) we
 	// need to check once more if there is any messages to send before leaving
 	// work handler
+	// bus is released between the bursts to let a pending interrupt service
+	// pass (rx first) in
 	for (i = 0; i < 2; i++) {
+		mutex_lock(&priv->bus->lock);
+
+		// interface is being closed, chip might already be detached
+		if (!netif_running(priv->ndev)) {
+			mutex_unlock(&priv->bus->lock);
+			return;
+		}
+
 		tcan4550_send_msgs(priv);
+		tcan4550_send_ring_msgs(priv);
+		mutex_unlock(&priv->bus->lock);
 	}
 }
 
@@ -503,16 +1069,29 @@ static void tcan4550_tx_work_handler(struct work_struct *ws)
 static void tcan4550_send_msgs(struct tcan4550_priv *priv)
 {
 	struct net_device_stats *stats = &(priv->ndev->stats);
-	uint32_t txqfs = spi_read32(priv->spi, TXQFS);
-	uint32_t freeBuffers = txqfs & 0x3F;
-	uint32_t writeIndex = (txqfs >> 16) & 0x1F;
+	uint32_t txqfs;
+	uint32_t freeBuffers;
+	uint32_t writeIndex;
 	uint32_t requestMask = 0;
 	uint32_t msgs = 0;
 	unsigned long flags;
+	uint32_t startAddress;
+	uint32_t maxMsgsToTransmit;
+	uint32_t firstIndex;
+	uint64_t spiNs;
+
+	// keep msgs in sw tx buffer until chip is recovered
+	if (priv->chip_lost) {
+		return;
+	}
 
-	uint32_t startAddress = MRAM_BASE + TX_FIFO_START_ADDRESS + (writeIndex * TX_SLOT_SIZE);
+	txqfs = spi_read32(priv->spi, TXQFS);
+	freeBuffers = tcan4550_txqfs_free_level(txqfs);
+	writeIndex = tcan4550_txqfs_put_index(txqfs);
+	firstIndex = writeIndex;
+	startAddress = tcan4550_tx_elem_address(writeIndex);
 
-	uint32_t maxMsgsToTransmit = freeBuffers;
+	maxMsgsToTransmit = freeBuffers;
 	if (maxMsgsToTransmit > MAX_SPI_BURST_TX_MESSAGES) {
 		maxMsgsToTransmit = MAX_SPI_BURST_TX_MESSAGES;
 	}
@@ -532,7 +1111,18 @@ static void tcan4550_send_msgs(struct tcan4550_priv *priv)
 			(struct can_frame *)priv->tx_skb_buf[priv->tx_skb_buf_tail]->data;
 
 		tcan4550_skbuff_to_tcan_msg(priv->tx_skb_buf[priv->tx_skb_buf_tail],
-					&priv->txBuffer[msgs * 4]);
+					&priv->bufs->txBuffer[msgs * 4]);
+
+		// store a tx event with the slot as message marker
+		if (priv->tx_lat.enabled) {
+			priv->bufs->txBuffer[(msgs * 4) + 1] |=
+				tcan4550_tx_event_marker(writeIndex);
+		}
+
+		priv->tx_lat.slot[writeIndex].xmit_ns =
+			priv->tx_skb_ts[priv->tx_skb_buf_tail];
+		priv->tx_lat.slot[writeIndex].cls =
+			tcan4550_tx_lat_class(priv, frame->can_id);
 
 		// put message on echo stack
 		can_put_echo_skb(priv->tx_skb_buf[priv->tx_skb_buf_tail],
@@ -567,10 +1157,14 @@ static void tcan4550_send_msgs(struct tcan4550_priv *priv)
 	spin_unlock_irqrestore(&priv->tx_skb_lock, flags);
 
 	if (msgs > 0) {
-		if (spi_write_msgs(priv, startAddress, msgs, priv->txBuffer) == 0) {
+		spiNs = ktime_get_ns();
+
+		if (spi_write_msgs(priv, startAddress, msgs, priv->bufs->txBuffer) == 0) {
 			spi_write32(priv->spi, TXBAR, requestMask); // request buffer transmission
+			tcan4550_tx_lat_requested(priv, firstIndex, msgs, spiNs);
 		} else {
 			dev_err(priv->dev, "spi_write_msgs failed\n");
+			tcan4550_health_kick(priv);
 		}
 	}
 }
@@ -583,6 +1177,7 @@ static int tcan4550_poll(struct napi_struct *_napi, int budget)
 	struct net_device_stats *stats = &(priv->ndev->stats);
 	uint32_t msgs = 0;
 	unsigned long flags;
+	uint64_t ns;
 
 	if (budget == 0) {
 		return 0;
@@ -598,30 +1193,16 @@ static int tcan4550_poll(struct napi_struct *_napi, int budget)
 		if (skb) {
 			uint32_t *data =
 				(uint32_t *)&priv->rx_skb_buf[priv->rx_skb_buf_tail].data;
-			cf->len = (data[1] >> 16) & 0x0F;
 
-			if (cf->len > 8) {
-				cf->len = 8;
+			if (!tcan4550_tcan_msg_to_can_frame(data, cf)) {
 				dev_info(priv->dev, "invalid frame length\n");
 			}
 
-			if (data[0] & TCAN_EXTENDED_FLAG) // extended
-			{
-				cf->can_id =
-					(data[0] & CAN_EFF_MASK) | CAN_EFF_FLAG;
-			} else {
-				cf->can_id = (data[0] >> 18) & CAN_SFF_MASK;
+			// rx timestamp of message in ptp clock time
+			if (tcan4550_ptp_rx_time(priv, data[1], &ns)) {
+				skb_hwtstamps(skb)->hwtstamp = ns_to_ktime(ns);
 			}
 
-			cf->data[0] = data[2] & 0xFF;
-			cf->data[1] = (data[2] >> 8) & 0xFF;
-			cf->data[2] = (data[2] >> 16) & 0xFF;
-			cf->data[3] = (data[2] >> 24) & 0xFF;
-			cf->data[4] = data[3] & 0xFF;
-			cf->data[5] = (data[3] >> 8) & 0xFF;
-			cf->data[6] = (data[3] >> 16) & 0xFF;
-			cf->data[7] = (data[3] >> 24) & 0xFF;
-
 			// send message to Linux networking stack
 			netif_receive_skb(skb);
 
@@ -643,6 +1224,12 @@ static int tcan4550_poll(struct napi_struct *_napi, int budget)
 		}
 	}
 
+	// backpressure, fetch msgs left in hw fifo now that there is room
+	if ((msgs > 0) && priv->rx_stalled) {
+		priv->rx_stalled = false;
+		queue_work(priv->wq, &priv->rx_work);
+	}
+
 	// If all messages did fit within budget, tell NAPI we are ready. If
 	// msgs=budget, we shall NOT call napi_complete_done
 	if (msgs < budget) {
@@ -654,91 +1241,386 @@ static int tcan4550_poll(struct napi_struct *_napi, int budget)
 	return msgs;
 }
 
-uint32_t tcan4550_rec_msgs(struct net_device *dev)
+/*------------------------------------------------------------*/
+/* Rx rate limit functions                                    */
+/*------------------------------------------------------------*/
+
+// check msg against the rx rate limits (token buckets). Returns false if the
+// msg shall be dropped. Called for every received msg before it is stored in
+// the sw rx buffer so a babbling node does not cost skb allocations and
+// socket wakeups.
+static bool tcan4550_rx_rate_ok(struct tcan4550_priv *priv, uint32_t t0)
 {
-	struct net_device_stats *stats = &(dev->stats);
-	struct tcan4550_priv *priv = netdev_priv(dev);
-	uint32_t rxf0s = spi_read32(priv->spi, RXF0S);
-	uint32_t fillLevel = ((rxf0s & 0x7F) < 64) ? (rxf0s & 0x7F) : 64; // 0-64
-	uint32_t getIndex = ((rxf0s >> 8) & 0x3F); // 0-63
-	uint32_t totalMsgsToGet;
-	uint32_t msgsToGet[2];
-	uint32_t startAddress[2];
-	uint32_t spiPackages = 1;
-	uint32_t i, spiPackage;
-	uint32_t msgsReceived = 0;
+	canid_t id;
+	uint64_t now;
+	unsigned long flags;
+	bool ok = true;
+	bool stormStarted = false;
+	uint32_t i;
 
-	if (fillLevel == 0) {
-		return 0;
+	// fast path, no limits configured
+	if (READ_ONCE(priv->rx_rate_limits_num) == 0) {
+		return true;
 	}
 
-	totalMsgsToGet = fillLevel;
-
-	startAddress[0] = MRAM_BASE + RX_FIFO_START_ADDRESS + (getIndex * RX_SLOT_SIZE);
-	startAddress[1] = MRAM_BASE + RX_FIFO_START_ADDRESS;
-
-	if (totalMsgsToGet > MAX_SPI_BURST_RX_MESSAGES) {
-		totalMsgsToGet = MAX_SPI_BURST_RX_MESSAGES;
-	}
+	id = tcan4550_tcan_msg_to_can_id(t0);
+	now = ktime_get_ns();
 
-	msgsToGet[0] = totalMsgsToGet;
+	spin_lock_irqsave(&priv->rx_rate_lock, flags);
 
-	// if hw rx buffer wraps around, we need to make two SPI requests to get all data
-	if (totalMsgsToGet > (RX_FIFO_SIZE - getIndex)) {
-		msgsToGet[0] = (RX_FIFO_SIZE - getIndex); // request as much as possible in SPI package 1
-		msgsToGet[1] = totalMsgsToGet - msgsToGet[0]; // request the rest in SPI package 2
+	for (i = 0; i < priv->rx_rate_limits_num; i++) {
+		struct tcan4550_rate_limit *rl = &priv->rx_rate_limits[i];
+		uint64_t maxTokens = (uint64_t)rl->burst * NSEC_PER_SEC;
+		uint64_t elapsed;
 
-		if (msgsToGet[1] > 0) {
-			spiPackages = 2;
+		if ((id < rl->first) || (id > rl->last)) {
+			continue;
 		}
-	}
 
-	for (spiPackage = 0; spiPackage < spiPackages; spiPackage++) {
-		if (spi_read_msgs(priv, startAddress[spiPackage],
-				  msgsToGet[spiPackage], priv->rxBuffer) == 0) {
-			uint32_t ack;
-			ack = (spiPackage == 0) ?
-					  (getIndex + msgsToGet[0] - 1) :
-					  (msgsToGet[1] - 1);
-
-			// acknowledge the last message we have read, that will automatically free all messages up until that message
-			spi_write32(priv->spi, RXF0A, ack);
-
-			for (i = 0; i < msgsToGet[spiPackage]; i++) {
-				unsigned long flags;
-				uint32_t tmpHead;
-				uint32_t *data =
-					(uint32_t *)&priv->rxBuffer[0 + (i * 4)];
-
-				// store skb in rx buffer
-				spin_lock_irqsave(&priv->rx_skb_lock, flags);
-
-				tmpHead = (priv->rx_skb_buf_head + 1) % RX_BUFFER_SIZE;
-				if (tmpHead != priv->rx_skb_buf_tail) {
-					priv->rx_skb_buf[priv->rx_skb_buf_head]
-						.data[0] = data[0];
-					priv->rx_skb_buf[priv->rx_skb_buf_head]
-						.data[1] = data[1];
-					priv->rx_skb_buf[priv->rx_skb_buf_head]
-						.data[2] = data[2];
-					priv->rx_skb_buf[priv->rx_skb_buf_head]
-						.data[3] = data[3];
-
-					priv->rx_skb_buf_head = tmpHead;
-
-					msgsReceived++;
-				} else {
-					stats->rx_dropped++;
-				}
+		// refill bucket, one msg costs NSEC_PER_SEC tokens
+		elapsed = now - rl->last_ns;
+		rl->last_ns = now;
+		if ((rl->rate == 0) || (elapsed >= div_u64(maxTokens, rl->rate))) {
+			rl->tokens = (rl->rate == 0) ? 0 : maxTokens;
+		} else {
+			rl->tokens = min(rl->tokens + (elapsed * rl->rate), maxTokens);
+		}
 
-				spin_unlock_irqrestore(&priv->rx_skb_lock, flags);
+		if (rl->tokens >= NSEC_PER_SEC) {
+			// storm has ended when the bucket had time to fill up again
+			if (rl->storm && (rl->tokens == maxTokens)) {
+				rl->storm = false;
+				netdev_info(priv->ndev,
+					    "rx rate limit %x-%x: storm ended, %llu msgs dropped in total\n",
+					    rl->first, rl->last, rl->dropped);
 			}
+			rl->tokens -= NSEC_PER_SEC;
 		} else {
-			dev_err(priv->dev, "spi_read_msgs failed\n");
+			rl->dropped++;
+			if (!rl->storm) {
+				rl->storm = true;
+				stormStarted = true;
+				netdev_warn(priv->ndev,
+					    "rx rate limit %x-%x: storm detected, dropping msgs\n",
+					    rl->first, rl->last);
+			}
+			ok = false;
 		}
-	}
 
-	return msgsReceived;
+		// first matching limit decides
+		break;
+	}
+
+	spin_unlock_irqrestore(&priv->rx_rate_lock, flags);
+
+	// let user space polling the attribute know about the storm
+	if (stormStarted) {
+		sysfs_notify(&priv->ndev->dev.kobj, NULL, "rx_rate_limits");
+	}
+
+	return ok;
+}
+
+// parse CAN id as written in rx_rate_limits, 8 hex digits gives an extended id
+static int tcan4550_parse_can_id(const char *str, canid_t *id)
+{
+	uint32_t val;
+	int ret = kstrtou32(str, 16, &val);
+
+	if (ret) {
+		return ret;
+	}
+
+	if (strlen(str) == 8) {
+		if (val > CAN_EFF_MASK) {
+			return -EINVAL;
+		}
+		*id = val | CAN_EFF_FLAG;
+	} else {
+		if (val > CAN_SFF_MASK) {
+			return -EINVAL;
+		}
+		*id = val;
+	}
+
+	return 0;
+}
+
+// parse "<id>" or "<first id>-<last id>"
+static int tcan4550_parse_can_id_range(char *str, canid_t *first, canid_t *last)
+{
+	char *dash = strchr(str, '-');
+	int ret;
+
+	if (dash) {
+		*dash = '\0';
+		ret = tcan4550_parse_can_id(dash + 1, last);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	ret = tcan4550_parse_can_id(str, first);
+	if (ret) {
+		return ret;
+	}
+
+	if (!dash) {
+		*last = *first;
+	}
+
+	// standard and extended ids cannot be mixed in one range
+	if ((*first > *last) ||
+	    ((*first & CAN_EFF_FLAG) != (*last & CAN_EFF_FLAG))) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+// start the read of the next burst of the rx fifo snapshot in pipeline slot
+// slot. A burst ends at MAX_SPI_BURST_RX_MESSAGES or where the hw rx fifo
+// wraps around. Returns NULL when the snapshot has been fully requested.
+static struct tcan4550_rx_burst *tcan4550_rx_burst_submit(
+	struct tcan4550_priv *priv, uint32_t slot, uint32_t *getIndex,
+	uint32_t *msgsLeft, bool acknowledge)
+{
+	struct tcan4550_rx_burst *burst =
+		&priv->bufs->rxBurst[slot % RX_PIPELINE_DEPTH];
+	uint32_t msgs;
+
+	msgs = min_t(uint32_t, *msgsLeft, MAX_SPI_BURST_RX_MESSAGES);
+	msgs = min_t(uint32_t, msgs, RX_FIFO_SIZE - *getIndex);
+	if (msgs == 0) {
+		return NULL;
+	}
+
+	// acknowledge the last message of the burst, that will automatically
+	// free all messages up until that message. A failed submit is reported
+	// when the burst is waited for.
+	spi_read_msgs_submit(priv, burst, tcan4550_rx_elem_address(*getIndex),
+			     msgs, acknowledge, *getIndex + msgs - 1);
+
+	*getIndex = (*getIndex + msgs) % RX_FIFO_SIZE;
+	*msgsLeft -= msgs;
+
+	return burst;
+}
+
+// store one rx fifo element in the sw rx buffer according to policy
+static void tcan4550_rx_store(struct tcan4550_priv *priv, const uint32_t *data,
+			      enum tcan4550_overload_policy policy)
+{
+	struct net_device_stats *stats = &priv->ndev->stats;
+	unsigned long flags;
+	uint32_t tmpHead;
+
+	// drop msgs exceeding their rate limit already here
+	if (!tcan4550_rx_rate_ok(priv, data[0])) {
+		stats->rx_dropped++;
+		return;
+	}
+
+	// store skb in rx buffer
+	spin_lock_irqsave(&priv->rx_skb_lock, flags);
+
+	tmpHead = (priv->rx_skb_buf_head + 1) % RX_BUFFER_SIZE;
+
+	// drop oldest msg to make room for the new one
+	if ((tmpHead == priv->rx_skb_buf_tail) &&
+	    (policy == RX_OVERLOAD_DROP_OLDEST)) {
+		priv->rx_skb_buf_tail =
+			(priv->rx_skb_buf_tail + 1) % RX_BUFFER_SIZE;
+		priv->rx_overload_stats.sw_dropped_oldest++;
+		stats->rx_dropped++;
+	}
+
+	if (tmpHead != priv->rx_skb_buf_tail) {
+		priv->rx_skb_buf[priv->rx_skb_buf_head].data[0] = data[0];
+		priv->rx_skb_buf[priv->rx_skb_buf_head].data[1] = data[1];
+		priv->rx_skb_buf[priv->rx_skb_buf_head].data[2] = data[2];
+		priv->rx_skb_buf[priv->rx_skb_buf_head].data[3] = data[3];
+
+		priv->rx_skb_buf_head = tmpHead;
+	} else {
+		priv->rx_overload_stats.sw_dropped_newest++;
+		stats->rx_dropped++;
+	}
+
+	spin_unlock_irqrestore(&priv->rx_skb_lock, flags);
+}
+
+// rx fifo read in overwrite mode (F0OM), with the read sequence of
+// tcan4550_hw.h shared with the user space driver. All bursts are read
+// without acknowledge, then the get index is read again.
+// Returns the number of msgs fetched from the chip, including dropped ones,
+// or a full pass when the fifo wraps and msgs are left after the bursts.
+static uint32_t tcan4550_rec_msgs_overwrite(struct tcan4550_priv *priv,
+					    uint32_t getIndex,
+					    uint32_t fillLevel)
+{
+	struct net_device_stats *stats = &priv->ndev->stats;
+	struct tcan4550_rx_burst *bursts[RX_PIPELINE_DEPTH];
+	uint32_t firstIndex = getIndex;
+	uint32_t skipped = tcan4550_rx_overwrite_skip(fillLevel);
+	uint32_t msgsRead = 0, stale, ack, msg, numBursts, i, j;
+	uint32_t totalMsgsToGet;
+	int ret = 0;
+
+	getIndex = (getIndex + skipped) % RX_FIFO_SIZE;
+
+	totalMsgsToGet = min_t(uint32_t, fillLevel - skipped,
+			       MAX_RX_MSGS_PER_PASS - skipped);
+
+	// async SPI messages bypass spi_transfer, hold the SPI lock while the
+	// bursts are in flight
+	mutex_lock(&priv->spi_lock);
+
+	for (numBursts = 0; numBursts < RX_PIPELINE_DEPTH; numBursts++) {
+		bursts[numBursts] = tcan4550_rx_burst_submit(priv, numBursts,
+							     &getIndex,
+							     &totalMsgsToGet,
+							     false);
+		if (!bursts[numBursts]) {
+			break;
+		}
+	}
+
+	for (i = 0; i < numBursts; i++) {
+		if (spi_read_msgs_wait(bursts[i]) == 0) {
+			msgsRead += bursts[i]->msgs;
+		} else {
+			ret = -EIO;
+		}
+	}
+
+	mutex_unlock(&priv->spi_lock);
+
+	// nothing is acknowledged, the msgs are read again on the next pass
+	if (ret) {
+		dev_err(priv->dev, "spi_read_msgs failed\n");
+		tcan4550_health_kick(priv);
+		return 0;
+	}
+
+	// hw get index after the read
+	getIndex = tcan4550_rxf0s_get_index(spi_read32(priv->spi, RXF0S));
+	stale = tcan4550_rx_overwrite_stale(firstIndex, getIndex, skipped,
+					    msgsRead);
+
+	priv->rx_overload_stats.hw_overwritten += stale;
+	stats->rx_errors += stale;
+	stats->rx_over_errors += stale;
+
+	msg = skipped;
+	for (i = 0; i < numBursts; i++) {
+		spi_read_msgs_unpack(bursts[i], priv->bufs->rxBuffer);
+
+		for (j = 0; j < bursts[i]->msgs; j++, msg++) {
+			if (msg >= stale) {
+				tcan4550_rx_store(priv,
+						  &priv->bufs->rxBuffer[j * 4],
+						  RX_OVERLOAD_DROP_OLDEST);
+			}
+		}
+	}
+
+	if (tcan4550_rx_overwrite_ack(firstIndex, stale, skipped, msgsRead,
+				      &ack)) {
+		spi_write32(priv->spi, RXF0A, ack);
+	}
+
+	if (totalMsgsToGet > 0) {
+		return MAX_RX_MSGS_PER_PASS;
+	}
+
+	return skipped + msgsRead;
+}
+
+// copy messages from rx fifo in CAN controller to sw rx buffer. Returns the
+// number of messages fetched from the chip, including dropped ones.
+// Reads are pipelined, the next burst is read and acknowledged by the SPI
+// controller while the previous burst is decoded.
+uint32_t tcan4550_rec_msgs(struct net_device *dev)
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+	uint32_t rxf0s = spi_read32(priv->spi, RXF0S);
+	uint32_t fillLevel = tcan4550_rxf0s_fill_level(rxf0s);
+	uint32_t getIndex = tcan4550_rxf0s_get_index(rxf0s);
+	uint32_t totalMsgsToGet;
+	uint32_t i, slot = 0;
+	uint32_t msgsFetched = 0;
+	struct tcan4550_rx_burst *burst, *next;
+	enum tcan4550_overload_policy policy = priv->rx_overload_policy;
+
+	if (fillLevel == 0) {
+		return 0;
+	}
+
+	if (policy == RX_OVERLOAD_DROP_OLDEST) {
+		return tcan4550_rec_msgs_overwrite(priv, getIndex, fillLevel);
+	}
+
+	totalMsgsToGet = fillLevel;
+
+	// backpressure, only fetch as many msgs as the sw rx buffer has room for.
+	// The rest is fetched when NAPI has made room (rx_work).
+	if (policy == RX_OVERLOAD_BACKPRESSURE) {
+		unsigned long flags;
+		uint32_t freeSlots;
+
+		spin_lock_irqsave(&priv->rx_skb_lock, flags);
+
+		freeSlots = (priv->rx_skb_buf_tail - priv->rx_skb_buf_head - 1 +
+			     RX_BUFFER_SIZE) % RX_BUFFER_SIZE;
+		if (totalMsgsToGet > freeSlots) {
+			totalMsgsToGet = freeSlots;
+			priv->rx_stalled = true;
+			priv->rx_overload_stats.backpressure_stalls++;
+		}
+
+		spin_unlock_irqrestore(&priv->rx_skb_lock, flags);
+
+		if (totalMsgsToGet == 0) {
+			return 0;
+		}
+	}
+
+	if (totalMsgsToGet > MAX_RX_MSGS_PER_PASS) {
+		totalMsgsToGet = MAX_RX_MSGS_PER_PASS;
+	}
+
+	// async SPI messages bypass spi_transfer, hold the SPI lock for the
+	// whole pipeline
+	mutex_lock(&priv->spi_lock);
+
+	burst = tcan4550_rx_burst_submit(priv, slot++, &getIndex, &totalMsgsToGet,
+					 true);
+	while (burst) {
+		// request the next burst before decoding this one
+		next = tcan4550_rx_burst_submit(priv, slot++, &getIndex,
+						&totalMsgsToGet, true);
+
+		if (spi_read_msgs_wait(burst) == 0) {
+			msgsFetched += burst->msgs;
+
+			spi_read_msgs_unpack(burst, priv->bufs->rxBuffer);
+
+			for (i = 0; i < burst->msgs; i++) {
+				tcan4550_rx_store(priv, &priv->bufs->rxBuffer[i * 4],
+						  policy);
+			}
+		} else {
+			dev_err(priv->dev, "spi_read_msgs failed\n");
+			tcan4550_health_kick(priv);
+		}
+
+		burst = next;
+	}
+
+	mutex_unlock(&priv->spi_lock);
+
+	return msgsFetched;
 }
 
 // go through errors in priority order (most severe error first)
@@ -817,152 +1699,1224 @@ static void tcan4550_handle_bus_status_change(void *dev)
 			}
 		}
 
-		return;
-	}
+		return;
+	}
+
+	// no errors found, set error active (bus is active - no errors)
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+}
+
+// handle all interrupt events of one chip except rx fifo new message which is
+// handled by the bus coordinator before anything else
+static void tcan4550_handle_events(struct tcan4550_priv *priv, uint32_t ir)
+{
+	struct net_device *dev = priv->ndev;
+
+	// rx fifo 0 message lost
+	if (ir & RF0LE) {
+		dev->stats.rx_errors++;
+		dev->stats.rx_over_errors++;
+		priv->rx_overload_stats.hw_lost++;
+	}
+
+	// rx fifo 0 full, only enabled in overwrite mode where new msgs now
+	// overwrite the oldest ones
+	if (ir & RF0F) {
+		priv->rx_overload_stats.hw_full++;
+	}
+
+	// tx event fifo new entry, only enabled for tx latency statistics
+	if ((ir & TEFN) && priv->tx_lat.enabled) {
+		tcan4550_tx_lat_complete(priv);
+	}
+
+	// tx fifo empty
+	if (ir & TFE) {
+		// note that queue can only contain one item of the tx_work type so if tx_work is already on queue, no new item will be added
+		queue_work(priv->wq, &priv->tx_work);
+
+		netif_wake_queue(dev);
+	}
+
+	// handle bus errors (error warning, error passive or bus off)
+	if ((ir & EW) || (ir & EP) || (ir & BO)) {
+		tcan4550_handle_bus_status_change(dev);
+	}
+}
+
+// interrupt handler - run as an irq thread
+// One handler is registered per interrupt line and SPI bus. It reads and
+// acknowledges the status of every chip on the line in one pass, then fetches
+// rx messages of all chips round robin, one pipelined rx pass of up to
+// RX_PIPELINE_DEPTH SPI bursts per chip and round, and handles the remaining
+// events last.
+static irqreturn_t tcan4550_handle_interrupts(int irq, void *data)
+{
+	struct tcan4550_bus *bus = data;
+	struct tcan4550_priv *chips[MAX_CHIPS_PER_BUS];
+	uint32_t ir[MAX_CHIPS_PER_BUS];
+	uint32_t firstSlot = 0; // slot in bus->chips of chips[0]
+	uint32_t rxPending = 0;
+	uint32_t numChips = 0;
+	uint32_t i, round;
+
+	mutex_lock(&bus->lock);
+
+	// NOTE: This pass might be blocked for a pretty long time due to long SPI
+	// burst transfers
+	for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+		uint32_t slot = (bus->next_chip + i) % MAX_CHIPS_PER_BUS;
+		struct tcan4550_priv *priv = bus->chips[slot];
+		uint32_t chipIr;
+
+		if (!priv || (priv->spi->irq != irq)) {
+			continue;
+		}
+
+		chipIr = spi_read32(priv->spi, IR);
+		if (chipIr == 0) {
+			continue;
+		}
+
+		// chip not responding or reset, let health check recover it
+		if (chipIr == 0xFFFFFFFF) {
+			tcan4550_health_kick(priv);
+			continue;
+		}
+
+		spi_write32(priv->spi, IR, chipIr); // acknowledge interrupts
+
+		if (numChips == 0) {
+			firstSlot = slot;
+		}
+
+		chips[numChips] = priv;
+		ir[numChips] = chipIr;
+
+		if (chipIr & RF0N) {
+			rxPending |= (1 << numChips);
+		}
+
+		numChips++;
+	}
+
+	// let next pass start with the chip after the one served first in this
+	// pass. Stepping over empty slots instead would favour the chip that
+	// follows a run of empty slots.
+	if (numChips > 0) {
+		bus->next_chip = (firstSlot + 1) % MAX_CHIPS_PER_BUS;
+	}
+
+	// no M_CAN interrupt pending. After a reset or brown out IR reads 0 while
+	// the power on flag holds the line low, so check the device interrupt
+	// flags before leaving a level triggered line asserted.
+	if (numChips == 0) {
+		irqreturn_t ret = IRQ_NONE;
+
+		for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+			struct tcan4550_priv *priv = bus->chips[i];
+			uint32_t flags;
+
+			if (!priv || (priv->spi->irq != irq)) {
+				continue;
+			}
+
+			flags = spi_read32(priv->spi, INTERRUPT_FLAGS);
+			if ((flags == 0) || (flags == 0xFFFFFFFF)) {
+				continue;
+			}
+
+			// release the line, health check restores the chip
+			if (flags & PWRON) {
+				priv->health_pwron = true;
+			}
+			spi_write32(priv->spi, INTERRUPT_FLAGS, flags);
+			tcan4550_health_kick(priv);
+			ret = IRQ_HANDLED;
+		}
+
+		mutex_unlock(&bus->lock);
+		return ret;
+	}
+
+	// rx fifo 0 new message. Fetch one rx pass (up to RX_PIPELINE_DEPTH
+	// pipelined bursts) per chip and round until all fifos are drained so a
+	// busy chip cannot starve the others
+	for (round = 0; (round < MAX_RX_ROUNDS) && rxPending; round++) {
+		for (i = 0; i < numChips; i++) {
+			if (!(rxPending & (1 << i))) {
+				continue;
+			}
+
+			// a pass of less than MAX_RX_MSGS_PER_PASS msgs means the
+			// fifo is drained
+			if (tcan4550_rec_msgs(chips[i]->ndev) < MAX_RX_MSGS_PER_PASS) {
+				rxPending &= ~(1 << i);
+			}
+
+			// disable bottom halves when calling napi_schedule to
+			// avoid error message "NOHZ tick-stop error: Non-RCU
+			// local softirq work is pending, handler #08!!!"
+			local_bh_disable();
+			napi_schedule(&chips[i]->napi);
+			local_bh_enable();
+		}
+	}
+
+	for (i = 0; i < numChips; i++) {
+		tcan4550_handle_events(chips[i], ir[i]);
+	}
+
+	mutex_unlock(&bus->lock);
+
+	return IRQ_HANDLED;
+}
+
+void tcan4550_setup_interrupts(struct spi_device *spi, bool rxOverwrite)
+{
+	// rx fifo 0 new message + tx fifo empty + bus off + error warning + error passive + rx fifo 0 msg lost
+	// (+ rx fifo 0 full in overwrite mode, where msgs are not reported lost)
+	spi_write32(spi, IE, RF0N + TFE + BO + EW + EP + RF0LE +
+			     (rxOverwrite ? RF0F : 0));
+	spi_write32(spi, ILE, 0x1); // enable interrupt line 1
+
+	// mask all spi errors
+	spi_write32(spi, SPI_MASK, 0xFFFFFFFF);
+
+	// clear spi status register
+	spi_write32(spi, STATUS, 0xFFFFFFFF);
+
+	// clear interrupts
+	spi_write32(spi, INTERRUPT_FLAGS, 0xFFFFFFFF);
+
+	// interrupt enables
+	spi_write32(spi, INTERRUPT_ENABLE, 0);
+}
+
+void tcan4550_setup_io(struct net_device *dev)
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+
+	// get reset gpio from devicetree reset-gpio property, set to output low
+	priv->reset_gpio = devm_gpiod_get_optional(priv->dev, "reset", GPIOD_OUT_LOW);
+
+	if (IS_ERR(priv->reset_gpio)) {
+		dev_err(priv->dev, "could not get reset GPIO\n");
+
+		priv->reset_gpio = NULL;
+	}
+}
+
+void tcan4550_hw_reset(struct net_device *dev)
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+
+	gpiod_set_value(priv->reset_gpio, 1);
+
+	// according to spec we need to toggle pin for at least 30us
+	usleep_range(30, 100);
+	gpiod_set_value(priv->reset_gpio, 0);
+
+	// according to spec we need to wait at least 700us for chip to become ready
+	usleep_range(700, 1000);
+}
+
+static void tcan4550_configure_control_modes(struct net_device *dev)
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+	uint32_t cccr = spi_read32(priv->spi, CCCR);
+	uint32_t test = spi_read32(priv->spi, TEST);
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK) {
+		cccr |= TEST_EN | MON;
+		test |= LBCK;
+	}
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY) {
+		cccr |= MON;
+	}
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT) {
+		cccr |= DAR;
+	}
+
+	cccr &= ~CSR; // clock stop should never be written 1 to even if reading returns 1
+
+	spi_write32(priv->spi, CCCR, cccr);
+	spi_write32(priv->spi, TEST, test);
+}
+
+// initialize TCAN4550 hardware
+static void tcan4550_init(struct net_device *dev)
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+	const struct can_bittiming *bt = &priv->can.bittiming;
+	uint32_t bitRateReg = tcan4550_nbtp(bt->brp, bt->prop_seg + bt->phase_seg1,
+					    bt->phase_seg2, bt->sjw);
+
+	tcan4550_set_standby_mode(priv->spi);
+	tcan4550_unlock(priv->spi);
+	tcan4550_set_bit_rate(priv->spi, bitRateReg);
+	tcan4550_configure_timestamps(priv->spi);
+	tcan4550_configure_mram(priv->spi,
+				priv->rx_overload_policy == RX_OVERLOAD_DROP_OLDEST);
+	tcan4550_configure_control_modes(dev);
+	tcan4550_setup_interrupts(priv->spi,
+				  priv->rx_overload_policy == RX_OVERLOAD_DROP_OLDEST);
+	tcan4550_tx_lat_setup_interrupts(priv);
+	tcan4550_save_cfg_image(priv);
+
+	// after this call, the TCAN chip is ready to send/receive messages
+	tcan4550_set_normal_mode(priv->spi);
+	priv->chip_lost = false;
+	priv->health_last_good_ns = ktime_get_ns();
+}
+
+/*------------------------------------------------------------*/
+/* PTP hardware clock functions                               */
+/*------------------------------------------------------------*/
+
+// The 16-bit timestamp counter of the chip counts CAN bit times. It is
+// extended to 64-bit ns by a timecounter that is updated at least four times
+// per counter wrap from the ptp aux worker. The counter is read over SPI, so
+// the raw value is read first (might sleep) and then latched into the
+// cyclecounter read callback under the spinlock.
+
+static uint64_t tcan4550_ptp_cc_read(const struct cyclecounter *cc)
+{
+	struct tcan4550_priv *priv = container_of(cc, struct tcan4550_priv, ptp_cc);
+
+	return priv->ptp_latched;
+}
+
+// read counter and update timecounter, returns current time in ns
+static uint64_t tcan4550_ptp_update(struct tcan4550_priv *priv,
+				    struct ptp_system_timestamp *sts)
+{
+	uint32_t raw = spi_read32_sts(priv->spi, TSCV, sts) & 0xFFFF;
+	uint64_t ns;
+
+	spin_lock_bh(&priv->ptp_lock);
+	priv->ptp_latched = raw;
+	ns = timecounter_read(&priv->ptp_tc);
+	priv->ptp_last_sys_ns = ktime_get_ns();
+	spin_unlock_bh(&priv->ptp_lock);
+
+	return ns;
+}
+
+static int tcan4550_ptp_gettimex64(struct ptp_clock_info *info,
+				   struct timespec64 *ts,
+				   struct ptp_system_timestamp *sts)
+{
+	struct tcan4550_priv *priv = container_of(info, struct tcan4550_priv, ptp_info);
+	uint64_t ns;
+
+	mutex_lock(&priv->ptp_mutex);
+
+	if (!priv->ptp_running) {
+		mutex_unlock(&priv->ptp_mutex);
+		return -ENETDOWN;
+	}
+
+	// system time is sampled by the SPI core around the word where the
+	// chip latches the counter, compensating for SPI latency
+	ns = tcan4550_ptp_update(priv, sts);
+
+	mutex_unlock(&priv->ptp_mutex);
+
+	*ts = ns_to_timespec64(ns);
+
+	return 0;
+}
+
+static int tcan4550_ptp_settime64(struct ptp_clock_info *info,
+				  const struct timespec64 *ts)
+{
+	struct tcan4550_priv *priv = container_of(info, struct tcan4550_priv, ptp_info);
+	uint32_t raw;
+
+	mutex_lock(&priv->ptp_mutex);
+
+	if (!priv->ptp_running) {
+		mutex_unlock(&priv->ptp_mutex);
+		return -ENETDOWN;
+	}
+
+	raw = spi_read32(priv->spi, TSCV) & 0xFFFF;
+
+	spin_lock_bh(&priv->ptp_lock);
+	priv->ptp_latched = raw;
+	timecounter_init(&priv->ptp_tc, &priv->ptp_cc, timespec64_to_ns(ts));
+	priv->ptp_last_sys_ns = ktime_get_ns();
+	spin_unlock_bh(&priv->ptp_lock);
+
+	mutex_unlock(&priv->ptp_mutex);
+
+	return 0;
+}
+
+static int tcan4550_ptp_adjtime(struct ptp_clock_info *info, int64_t delta)
+{
+	struct tcan4550_priv *priv = container_of(info, struct tcan4550_priv, ptp_info);
+
+	spin_lock_bh(&priv->ptp_lock);
+	timecounter_adjtime(&priv->ptp_tc, delta);
+	spin_unlock_bh(&priv->ptp_lock);
+
+	return 0;
+}
+
+// frequency is adjusted by scaling the ns per counter tick
+static int tcan4550_ptp_adjfine(struct ptp_clock_info *info, long scaled_ppm)
+{
+	struct tcan4550_priv *priv = container_of(info, struct tcan4550_priv, ptp_info);
+	bool negative = (scaled_ppm < 0);
+	uint64_t diff;
+	uint32_t raw;
+
+	if (negative) {
+		scaled_ppm = -scaled_ppm;
+	}
+
+	mutex_lock(&priv->ptp_mutex);
+
+	diff = mul_u64_u64_div_u64(priv->ptp_base_mult, scaled_ppm,
+				   1000000ULL << 16);
+
+	// accumulate time elapsed at the old rate before switching rate
+	raw = priv->ptp_running ? (spi_read32(priv->spi, TSCV) & 0xFFFF) : 0;
+
+	spin_lock_bh(&priv->ptp_lock);
+	if (priv->ptp_running) {
+		priv->ptp_latched = raw;
+		timecounter_read(&priv->ptp_tc);
+		priv->ptp_last_sys_ns = ktime_get_ns();
+	}
+	priv->ptp_scaled_ppm = negative ? -scaled_ppm : scaled_ppm;
+	priv->ptp_cc.mult = negative ? (priv->ptp_base_mult - diff) :
+				       (priv->ptp_base_mult + diff);
+	spin_unlock_bh(&priv->ptp_lock);
+
+	mutex_unlock(&priv->ptp_mutex);
+
+	return 0;
+}
+
+static int tcan4550_ptp_enable(struct ptp_clock_info *info,
+			       struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
+
+// keep timecounter ahead of counter wrap
+static long tcan4550_ptp_do_aux_work(struct ptp_clock_info *info)
+{
+	struct tcan4550_priv *priv = container_of(info, struct tcan4550_priv, ptp_info);
+	long delay = -1; // do not reschedule
+
+	mutex_lock(&priv->ptp_mutex);
+
+	if (priv->ptp_running) {
+		tcan4550_ptp_update(priv, NULL);
+		delay = priv->ptp_update_jiffies;
+	}
+
+	mutex_unlock(&priv->ptp_mutex);
+
+	return delay;
+}
+
+// convert a raw rx timestamp to ns. Called from NAPI, must not sleep.
+static bool tcan4550_ptp_rx_time(struct tcan4550_priv *priv, uint32_t raw,
+				 uint64_t *ns)
+{
+	unsigned long flags;
+
+	if (!READ_ONCE(priv->ptp_running)) {
+		return false;
+	}
+
+	spin_lock_irqsave(&priv->ptp_lock, flags);
+	*ns = timecounter_cyc2time(&priv->ptp_tc, raw & 0xFFFF);
+	spin_unlock_irqrestore(&priv->ptp_lock, flags);
+
+	return true;
+}
+
+// system time at raw timestamp counter value, counted from the counter value
+// and system time of the last timecounter update. Raw must be within half a
+// counter wrap of that update.
+static bool tcan4550_ptp_sys_time(struct tcan4550_priv *priv, uint32_t raw,
+				  uint64_t *ns)
+{
+	unsigned long flags;
+	int16_t ticks;
+	uint64_t frac = 0;
+	uint64_t delta;
+
+	if (!READ_ONCE(priv->ptp_running)) {
+		return false;
+	}
+
+	spin_lock_irqsave(&priv->ptp_lock, flags);
+	ticks = (int16_t)((raw - priv->ptp_latched) & 0xFFFF);
+	delta = cyclecounter_cyc2ns(&priv->ptp_cc, abs(ticks), 0, &frac);
+	*ns = (ticks < 0) ? (priv->ptp_last_sys_ns - delta) :
+			    (priv->ptp_last_sys_ns + delta);
+	spin_unlock_irqrestore(&priv->ptp_lock, flags);
+
+	return true;
+}
+
+// start extending the counter, called when the interface is opened and the
+// counter has been configured for the current bit rate
+static void tcan4550_ptp_start(struct tcan4550_priv *priv)
+{
+	uint32_t bitrate = priv->can.bittiming.bitrate;
+	uint64_t ticksPerSec = bitrate / TIMESTAMP_PRESCALER;
+	uint32_t tickNs = DIV_ROUND_UP((uint64_t)NSEC_PER_SEC * TIMESTAMP_PRESCALER, bitrate);
+	uint32_t shift = 31 - fls(tickNs); // keep one bit headroom for adjfine
+	uint64_t diff;
+	uint32_t raw;
+
+	if (!priv->ptp_clock || (bitrate == 0)) {
+		return;
+	}
+
+	mutex_lock(&priv->ptp_mutex);
+
+	priv->ptp_base_mult = div_u64(((uint64_t)NSEC_PER_SEC * TIMESTAMP_PRESCALER) << shift,
+				      bitrate);
+	diff = mul_u64_u64_div_u64(priv->ptp_base_mult, abs(priv->ptp_scaled_ppm),
+				   1000000ULL << 16);
+
+	priv->ptp_cc.read = tcan4550_ptp_cc_read;
+	priv->ptp_cc.mask = CYCLECOUNTER_MASK(16);
+	priv->ptp_cc.shift = shift;
+	priv->ptp_cc.mult = (priv->ptp_scaled_ppm < 0) ?
+				    (priv->ptp_base_mult - diff) :
+				    (priv->ptp_base_mult + diff);
+
+	// update four times per counter wrap
+	priv->ptp_update_jiffies = max_t(long, 1,
+		(long)div_u64((uint64_t)HZ * 0x10000, ticksPerSec * 4));
+
+	raw = spi_read32(priv->spi, TSCV) & 0xFFFF;
+
+	spin_lock_bh(&priv->ptp_lock);
+	priv->ptp_latched = raw;
+	timecounter_init(&priv->ptp_tc, &priv->ptp_cc, ktime_get_real_ns());
+	priv->ptp_last_sys_ns = ktime_get_ns();
+	spin_unlock_bh(&priv->ptp_lock);
+
+	WRITE_ONCE(priv->ptp_running, true);
+
+	mutex_unlock(&priv->ptp_mutex);
+
+	ptp_schedule_worker(priv->ptp_clock, priv->ptp_update_jiffies);
+}
+
+// counter restarts from 0 after a chip reset. Continue the clock from the
+// last known time plus the system time elapsed since then.
+static void tcan4550_ptp_resync(struct tcan4550_priv *priv)
+{
+	uint32_t raw;
+
+	if (!priv->ptp_clock) {
+		return;
+	}
+
+	mutex_lock(&priv->ptp_mutex);
+
+	if (priv->ptp_running) {
+		raw = spi_read32(priv->spi, TSCV) & 0xFFFF;
+
+		spin_lock_bh(&priv->ptp_lock);
+		priv->ptp_latched = raw;
+		timecounter_init(&priv->ptp_tc, &priv->ptp_cc,
+				 priv->ptp_tc.nsec + (ktime_get_ns() - priv->ptp_last_sys_ns));
+		priv->ptp_last_sys_ns = ktime_get_ns();
+		spin_unlock_bh(&priv->ptp_lock);
+	}
+
+	mutex_unlock(&priv->ptp_mutex);
+}
+
+static void tcan4550_ptp_stop(struct tcan4550_priv *priv)
+{
+	if (!priv->ptp_clock) {
+		return;
+	}
+
+	mutex_lock(&priv->ptp_mutex);
+	WRITE_ONCE(priv->ptp_running, false);
+	mutex_unlock(&priv->ptp_mutex);
+
+	ptp_cancel_worker_sync(priv->ptp_clock);
+}
+
+static void tcan4550_ptp_register(struct tcan4550_priv *priv)
+{
+	struct ptp_clock_info *info = &priv->ptp_info;
+
+	spin_lock_init(&priv->ptp_lock);
+	mutex_init(&priv->ptp_mutex);
+
+	info->owner = THIS_MODULE;
+	snprintf(info->name, sizeof(info->name), "tcan4550 %s", dev_name(priv->dev));
+	info->max_adj = PTP_MAX_ADJ_PPB;
+	info->adjfine = tcan4550_ptp_adjfine;
+	info->adjtime = tcan4550_ptp_adjtime;
+	info->gettimex64 = tcan4550_ptp_gettimex64;
+	info->settime64 = tcan4550_ptp_settime64;
+	info->enable = tcan4550_ptp_enable;
+	info->do_aux_work = tcan4550_ptp_do_aux_work;
+
+	// returns NULL if ptp support is not enabled in kernel
+	priv->ptp_clock = ptp_clock_register(info, priv->dev);
+	if (IS_ERR(priv->ptp_clock)) {
+		dev_err(priv->dev, "could not register ptp clock\n");
+		priv->ptp_clock = NULL;
+	}
+}
+
+static void tcan4550_ptp_unregister(struct tcan4550_priv *priv)
+{
+	if (priv->ptp_clock) {
+		ptp_clock_unregister(priv->ptp_clock);
+		priv->ptp_clock = NULL;
+	}
+}
+
+/*------------------------------------------------------------*/
+/* Ethtool functions                                          */
+/*------------------------------------------------------------*/
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+static int tcan4550_get_ts_info(struct net_device *dev,
+				struct kernel_ethtool_ts_info *info)
+#else
+static int tcan4550_get_ts_info(struct net_device *dev,
+				struct ethtool_ts_info *info)
+#endif
+{
+	struct tcan4550_priv *priv = netdev_priv(dev);
+
+	info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+				SOF_TIMESTAMPING_RX_SOFTWARE |
+				SOF_TIMESTAMPING_SOFTWARE;
+	info->phc_index = -1;
+
+	if (priv->ptp_clock) {
+		info->so_timestamping |= SOF_TIMESTAMPING_RX_HARDWARE |
+					 SOF_TIMESTAMPING_RAW_HARDWARE;
+		info->phc_index = ptp_clock_index(priv->ptp_clock);
+		info->tx_types = BIT(HWTSTAMP_TX_OFF);
+		info->rx_filters = BIT(HWTSTAMP_FILTER_ALL);
+	}
+
+	return 0;
+}
+
+static const struct ethtool_ops tcan4550_ethtool_ops = {
+	.get_ts_info = tcan4550_get_ts_info,
+};
+
+/*------------------------------------------------------------*/
+/* Chip health monitoring functions                           */
+/*------------------------------------------------------------*/
+
+// save configuration written by tcan4550_init so it can be restored quickly
+// if the chip loses it (brown out or reset). Called with CCE and INIT set.
+static void tcan4550_save_cfg_image(struct tcan4550_priv *priv)
+{
+	struct tcan4550_cfg_image *img = &priv->cfg_image;
+
+	img->cccr = spi_read32(priv->spi, CCCR) & ~((uint32_t)CSR);
+	img->test = spi_read32(priv->spi, TEST);
+	img->nbtp = spi_read32(priv->spi, NBTP);
+	img->tscc = spi_read32(priv->spi, TSCC);
+	img->txbc = spi_read32(priv->spi, TXBC);
+	img->rxf0c = spi_read32(priv->spi, RXF0C);
+	img->txesc = spi_read32(priv->spi, TXESC);
+	img->rxesc = spi_read32(priv->spi, RXESC);
+	img->txefc = spi_read32(priv->spi, TXEFC);
+	img->ie = spi_read32(priv->spi, IE);
+	img->ile = spi_read32(priv->spi, ILE);
+	img->txbtie = spi_read32(priv->spi, TXBTIE);
+}
+
+// write saved configuration to a chip that has just been reset, this skips
+// all read-modify-write of tcan4550_init
+static void tcan4550_restore_cfg_image(struct tcan4550_priv *priv)
+{
+	struct tcan4550_cfg_image *img = &priv->cfg_image;
+
+	tcan4550_set_standby_mode(priv->spi);
+	tcan4550_unlock(priv->spi);
+
+	// CCCR first as it enables writing to the protected registers
+	spi_write32(priv->spi, CCCR, img->cccr);
+	spi_write32(priv->spi, TEST, img->test);
+	spi_write32(priv->spi, NBTP, img->nbtp);
+	spi_write32(priv->spi, TSCC, img->tscc);
+
+	tcan4550_clear_mram(priv->spi);
+	spi_write32(priv->spi, TXBC, img->txbc);
+	spi_write32(priv->spi, RXF0C, img->rxf0c);
+	spi_write32(priv->spi, TXESC, img->txesc);
+	spi_write32(priv->spi, RXESC, img->rxesc);
+	spi_write32(priv->spi, TXEFC, img->txefc);
+
+	tcan4550_setup_interrupts(priv->spi, false);
+	spi_write32(priv->spi, TXBTIE, img->txbtie);
+	spi_write32(priv->spi, IE, img->ie);
+	spi_write32(priv->spi, ILE, img->ile);
+	priv->tx_lat.pending = 0;
+
+	tcan4550_set_normal_mode(priv->spi);
+}
+
+// check if chip still has the configuration written by tcan4550_init.
+// Returns a description of the failed check or NULL if chip is healthy.
+static const char *tcan4550_check_health(struct tcan4550_priv *priv)
+{
+	uint32_t modes;
+
+	if (!tcan4550_read_identification(priv->spi)) {
+		return "identification";
+	}
+
+	modes = spi_read32(priv->spi, MODES_OF_OPERATION);
+	if ((modes & (MODESEL_1 | MODESEL_2)) != MODESEL_2) {
+		return "mode of operation";
+	}
+
+	// power on flag is cleared by tcan4550_init and only set again by reset.
+	// The interrupt handler clears it to release the interrupt line.
+	if (priv->health_pwron ||
+	    (spi_read32(priv->spi, INTERRUPT_FLAGS) & PWRON)) {
+		priv->health_pwron = false;
+		return "power on flag";
+	}
+
+	return NULL;
+}
+
+// reset chip and restore configuration, the netdev is kept up. Called with
+// bus locked.
+static bool tcan4550_recover(struct tcan4550_priv *priv)
+{
+	tcan4550_hw_reset(priv->ndev);
+
+	// first read after reset might fail, see tcan_probe
+	tcan4550_read_identification(priv->spi);
+	if (!tcan4550_read_identification(priv->spi)) {
+		return false;
+	}
+
+	tcan4550_restore_cfg_image(priv);
+	priv->health_pwron = false;
+
+	return true;
+}
+
+// called periodically from work queue and directly when an anomaly is seen
+static void tcan4550_health_work_handler(struct work_struct *ws)
+{
+	struct tcan4550_priv *priv = container_of(to_delayed_work(ws),
+						  struct tcan4550_priv, health_work);
+	struct net_device *ndev = priv->ndev;
+	const char *failed = NULL;
+	bool recovered = false;
+	uint64_t now;
+
+	if (!netif_running(ndev) || !netif_device_present(ndev)) {
+		return;
+	}
+
+	mutex_lock(&priv->bus->lock);
+
+	// chip is restarted by the bus off handling
+	if (priv->can.state != CAN_STATE_BUS_OFF) {
+		failed = tcan4550_check_health(priv);
+	}
+
+	if (failed) {
+		if (!priv->chip_lost) {
+			priv->chip_lost = true;
+			netif_stop_queue(ndev);
+			netdev_warn(ndev, "chip lost configuration (%s check failed), recovering\n",
+				    failed);
+		}
+
+		recovered = tcan4550_recover(priv);
+	}
+
+	now = ktime_get_ns();
+
+	if (recovered) {
+		uint64_t outage = now - priv->health_last_good_ns;
+
+		priv->chip_lost = false;
+		priv->health_recoveries++;
+		priv->health_last_outage_ns = outage;
+		priv->health_max_outage_ns = max(priv->health_max_outage_ns, outage);
+	}
+
+	if (!priv->chip_lost) {
+		priv->health_last_good_ns = now;
+	}
+
+	mutex_unlock(&priv->bus->lock);
+
+	if (recovered) {
+		struct sk_buff *skb;
+		struct can_frame *cf;
+
+		netdev_warn(ndev, "chip recovered, outage %llu us\n",
+			    div_u64(priv->health_last_outage_ns, NSEC_PER_USEC));
+
+		tcan4550_ptp_resync(priv);
+
+		// tell user space that the controller has been restarted
+		skb = alloc_can_err_skb(ndev, &cf);
+		if (skb) {
+			cf->can_id |= CAN_ERR_RESTARTED;
+			netif_rx(skb);
+		}
+
+		priv->can.state = CAN_STATE_ERROR_ACTIVE;
+		netif_wake_queue(ndev);
+		queue_work(priv->wq, &priv->tx_work);
+	}
+
+	queue_delayed_work(priv->wq, &priv->health_work,
+			   msecs_to_jiffies(HEALTH_CHECK_INTERVAL_MS));
+}
+
+// check chip health now instead of waiting for next periodic check
+static void tcan4550_health_kick(struct tcan4550_priv *priv)
+{
+	mod_delayed_work(priv->wq, &priv->health_work, 0);
+}
+
+/*------------------------------------------------------------*/
+/* Memory mapped tx ring functions                            */
+/*------------------------------------------------------------*/
+
+// copy runs of msgs from the memory mapped tx ring to tx fifo in CAN
+// controller and request transmission. Elements are already in the format of
+// the chip, so they only need to be sanitized.
+static void tcan4550_send_ring_msgs(struct tcan4550_priv *priv)
+{
+	struct tcan4550_txring *ring = priv->txring;
+	struct net_device_stats *stats = &(priv->ndev->stats);
+	uint32_t consumer = priv->txring_consumer;
+	uint32_t producer;
+	uint32_t pending;
+	uint32_t txqfs;
+	uint32_t writeIndex;
+	uint32_t requestMask = 0;
+	uint32_t msgs;
+	uint32_t i;
+	uint64_t spiNs;
+
+	if (!ring || priv->chip_lost) {
+		return;
+	}
+
+	// elements written by user space are visible once producer is
+	producer = smp_load_acquire(&ring->producer);
+	pending = producer - consumer;
+	if (pending == 0) {
+		return;
+	}
+
+	if (pending > TCAN4550_TXRING_ENTRIES) {
+		dev_err_ratelimited(priv->dev, "invalid tx ring producer index\n");
+		return;
+	}
+
+	txqfs = spi_read32(priv->spi, TXQFS);
+	writeIndex = tcan4550_txqfs_put_index(txqfs);
+	msgs = min3(pending, tcan4550_txqfs_free_level(txqfs),
+		    (uint32_t)MAX_SPI_BURST_TX_MESSAGES);
+
+	// Make sure TX buffer does not wrap around
+	msgs = min(msgs, TX_FIFO_SIZE - writeIndex);
+
+	if (msgs == 0) {
+		return;
+	}
+
+	for (i = 0; i < msgs; i++) {
+		struct tcan4550_txring_elem *elem =
+			&ring->elem[(consumer + i) & (TCAN4550_TXRING_ENTRIES - 1)];
+		uint32_t t1 = READ_ONCE(elem->data[1]) & (0xFUL << 16); // dlc only
+		uint32_t len = min(t1 >> 16, 8U);
+
+		// id, rtr and extended flag only
+		priv->bufs->txBuffer[(i * 4) + 0] = READ_ONCE(elem->data[0]) & 0x7FFFFFFF;
+		priv->bufs->txBuffer[(i * 4) + 1] = t1;
+		if (priv->tx_lat.enabled) {
+			priv->bufs->txBuffer[(i * 4) + 1] |=
+				tcan4550_tx_event_marker(writeIndex + i);
+		}
+		priv->bufs->txBuffer[(i * 4) + 2] = READ_ONCE(elem->data[2]);
+		priv->bufs->txBuffer[(i * 4) + 3] = READ_ONCE(elem->data[3]);
+
+		requestMask += (1 << (writeIndex + i));
+
+		priv->tx_lat.slot[writeIndex + i].xmit_ns = 0;
+		priv->tx_lat.slot[writeIndex + i].cls = tcan4550_tx_lat_class(priv,
+			tcan4550_tcan_msg_to_can_id(priv->bufs->txBuffer[i * 4]));
+
+		stats->tx_packets++;
+		stats->tx_bytes += len;
+	}
+
+	spiNs = ktime_get_ns();
+
+	if (spi_write_msgs(priv, tcan4550_tx_elem_address(writeIndex), msgs,
+			   priv->bufs->txBuffer) == 0) {
+		spi_write32(priv->spi, TXBAR, requestMask); // request buffer transmission
+		tcan4550_tx_lat_requested(priv, writeIndex, msgs, spiNs);
+	} else {
+		dev_err(priv->dev, "spi_write_msgs failed\n");
+		tcan4550_health_kick(priv);
+	}
+
+	// hand elements back to user space
+	priv->txring_consumer = consumer + msgs;
+	smp_store_release(&ring->consumer, priv->txring_consumer);
+	wake_up_interruptible(&priv->txring_wait);
+}
+
+static struct tcan4550_priv *tcan4550_txring_priv(struct file *file)
+{
+	// misc device core sets private_data to the misc device on open
+	struct miscdevice *misc = file->private_data;
+
+	return container_of(misc, struct tcan4550_priv, txring_misc);
+}
+
+// open files keep priv, which is allocated with the net device, alive after
+// the device has been removed
+static int tcan4550_txring_open(struct inode *inode, struct file *file)
+{
+	struct tcan4550_priv *priv = tcan4550_txring_priv(file);
+
+	get_device(&priv->ndev->dev);
+
+	return 0;
+}
+
+static int tcan4550_txring_release(struct inode *inode, struct file *file)
+{
+	struct tcan4550_priv *priv = tcan4550_txring_priv(file);
+
+	put_device(&priv->ndev->dev);
 
-	// no errors found, set error active (bus is active - no errors)
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	return 0;
 }
 
-// interrupt handler - run as an irq thread
-static irqreturn_t tcan4550_handle_interrupts(int irq, void *dev)
+static int tcan4550_txring_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	struct tcan4550_priv *priv = netdev_priv(dev);
-	uint32_t ir;
+	struct tcan4550_priv *priv = tcan4550_txring_priv(file);
+	int ret = -ENODEV;
 
-	// NOTE: This call might be blocked for a pretty long time due to long SPI
-	// burst transfers
-	ir = spi_read32(priv->spi, IR);
-	spi_write32(priv->spi, IR, ir); // acknowledge interrupts
-
-	if (ir == 0) {
-		return IRQ_NONE;
+	mutex_lock(&priv->txring_lock);
+	if (!priv->txring_gone) {
+		ret = remap_vmalloc_range(vma, priv->txring, vma->vm_pgoff);
 	}
+	mutex_unlock(&priv->txring_lock);
 
-	// rx fifo 0 new message
-	if (ir & RF0N) {
-		tcan4550_rec_msgs(dev);
+	return ret;
+}
 
-		// disable bottom halves when calling napi_schedule to
-		// avoid error message "NOHZ tick-stop error: Non-RCU
-		// local softirq work is pending, handler #08!!!"
-		local_bh_disable();
-		napi_schedule(&priv->napi);
-		local_bh_enable();
-	}
+static long tcan4550_txring_ioctl(struct file *file, unsigned int cmd,
+				  unsigned long arg)
+{
+	struct tcan4550_priv *priv = tcan4550_txring_priv(file);
+	long ret;
+
+	switch (cmd) {
+	case TCAN4550_TXRING_KICK:
+		mutex_lock(&priv->txring_lock);
+		if (priv->txring_gone) {
+			ret = -ENODEV;
+		} else if (!netif_running(priv->ndev)) {
+			ret = -ENETDOWN;
+		} else {
+			queue_work(priv->wq, &priv->tx_work);
+			ret = 0;
+		}
+		mutex_unlock(&priv->txring_lock);
+		return ret;
 
-	// rx fifo 0 message lost
-	if (ir & RF0LE) {
-		priv->ndev->stats.rx_errors++;
-		priv->ndev->stats.rx_over_errors++;
+	default:
+		return -ENOTTY;
 	}
+}
 
-	// tx fifo empty
-	if (ir & TFE) {
-		// note that queue can only contain one item of the tx_work type so if tx_work is already on queue, no new item will be added
-		queue_work(priv->wq, &priv->tx_work);
+static __poll_t tcan4550_txring_poll(struct file *file, poll_table *wait)
+{
+	struct tcan4550_priv *priv = tcan4550_txring_priv(file);
+	__poll_t mask = 0;
+	uint32_t used;
 
-		netif_wake_queue(dev);
-	}
+	poll_wait(file, &priv->txring_wait, wait);
 
-	// handle bus errors (error warning, error passive or bus off)
-	if ((ir & EW) || (ir & EP) || (ir & BO)) {
-		tcan4550_handle_bus_status_change(dev);
+	mutex_lock(&priv->txring_lock);
+	if (priv->txring_gone) {
+		mask = EPOLLERR | EPOLLHUP;
+	} else {
+		used = READ_ONCE(priv->txring->producer) -
+		       READ_ONCE(priv->txring_consumer);
+		if (used < TCAN4550_TXRING_ENTRIES) {
+			mask = EPOLLOUT | EPOLLWRNORM;
+		}
 	}
+	mutex_unlock(&priv->txring_lock);
 
-	return IRQ_HANDLED;
+	return mask;
 }
 
-void tcan4550_setup_interrupts(struct spi_device *spi)
+static const struct file_operations tcan4550_txring_fops = {
+	.owner = THIS_MODULE,
+	.open = tcan4550_txring_open,
+	.release = tcan4550_txring_release,
+	.mmap = tcan4550_txring_mmap,
+	.unlocked_ioctl = tcan4550_txring_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0)
+	.compat_ioctl = compat_ptr_ioctl, // 32-bit user space on 64-bit kernel
+#endif
+	.poll = tcan4550_txring_poll,
+	.llseek = noop_llseek,
+};
+
+static int tcan4550_txring_register(struct tcan4550_priv *priv)
 {
-	// rx fifo 0 new message + tx fifo empty + bus off + error warning + error passive + rx fifo 0 msg lost
-	spi_write32(spi, IE, RF0N + TFE + BO + EW + EP + RF0LE);
-	spi_write32(spi, ILE, 0x1); // enable interrupt line 1
+	int err;
 
-	// mask all spi errors
-	spi_write32(spi, SPI_MASK, 0xFFFFFFFF);
+	init_waitqueue_head(&priv->txring_wait);
+	mutex_init(&priv->txring_lock);
+	priv->txring_gone = false;
 
-	// clear spi status register
-	spi_write32(spi, STATUS, 0xFFFFFFFF);
+	priv->txring = vmalloc_user(sizeof(struct tcan4550_txring));
+	if (!priv->txring) {
+		return -ENOMEM;
+	}
+	priv->txring_consumer = 0;
 
-	// clear interrupts
-	spi_write32(spi, INTERRUPT_FLAGS, 0xFFFFFFFF);
+	priv->txring_misc.minor = MISC_DYNAMIC_MINOR;
+	priv->txring_misc.name = devm_kasprintf(priv->dev, GFP_KERNEL, "tcan4550-%s",
+						dev_name(priv->dev));
+	priv->txring_misc.fops = &tcan4550_txring_fops;
+	priv->txring_misc.parent = priv->dev;
 
-	// interrupt enables
-	spi_write32(spi, INTERRUPT_ENABLE, 0);
+	err = priv->txring_misc.name ? misc_register(&priv->txring_misc) : -ENOMEM;
+	if (err) {
+		vfree(priv->txring);
+		priv->txring = NULL;
+	}
+
+	return err;
 }
 
-void tcan4550_setup_io(struct net_device *dev)
+static void tcan4550_txring_unregister(struct tcan4550_priv *priv)
 {
-	struct tcan4550_priv *priv = netdev_priv(dev);
+	if (priv->txring) {
+		misc_deregister(&priv->txring_misc);
+
+		// files still open fail from now on. Pages mapped by user space
+		// are freed when they are unmapped.
+		mutex_lock(&priv->txring_lock);
+		priv->txring_gone = true;
+		mutex_unlock(&priv->txring_lock);
+		wake_up_interruptible(&priv->txring_wait);
+
+		vfree(priv->txring);
+		priv->txring = NULL;
+	}
+}
 
-	// get reset gpio from devicetree reset-gpio property, set to output low
-	priv->reset_gpio = devm_gpiod_get_optional(priv->dev, "reset", GPIOD_OUT_LOW);
+/*------------------------------------------------------------*/
+/* SPI bus coordinator functions                              */
+/*------------------------------------------------------------*/
 
-	if (IS_ERR(priv->reset_gpio)) {
-		dev_err(priv->dev, "could not get reset GPIO\n");
+// all bus coordinators, one per SPI controller with TCAN4550 chips attached
+static LIST_HEAD(tcan4550_buses);
+static DEFINE_MUTEX(tcan4550_buses_lock); // protects tcan4550_buses and irq lines
 
-		priv->reset_gpio = NULL;
+// get the bus coordinator of the SPI controller the chip is connected to,
+// allocate a new one if this is the first chip on the controller
+static struct tcan4550_bus *tcan4550_bus_get(struct spi_device *spi)
+{
+	struct tcan4550_bus *bus;
+
+	mutex_lock(&tcan4550_buses_lock);
+
+	list_for_each_entry(bus, &tcan4550_buses, list) {
+		if (bus->ctlr == spi->controller) {
+			bus->refs++;
+			mutex_unlock(&tcan4550_buses_lock);
+			return bus;
+		}
 	}
-}
 
-void tcan4550_hw_reset(struct net_device *dev)
-{
-	struct tcan4550_priv *priv = netdev_priv(dev);
+	bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+	if (!bus) {
+		mutex_unlock(&tcan4550_buses_lock);
+		return NULL;
+	}
 
-	gpiod_set_value(priv->reset_gpio, 1);
+	// ordered queue, only one work item of any chip on the bus is executing
+	// at the same time
+	bus->wq = alloc_ordered_workqueue("tcan4550_wq", WQ_FREEZABLE | WQ_MEM_RECLAIM);
+	if (!bus->wq) {
+		kfree(bus);
+		mutex_unlock(&tcan4550_buses_lock);
+		return NULL;
+	}
 
-	// according to spec we need to toggle pin for at least 30us
-	usleep_range(30, 100);
-	gpiod_set_value(priv->reset_gpio, 0);
+	bus->ctlr = spi->controller;
+	bus->refs = 1;
+	mutex_init(&bus->lock);
+	list_add(&bus->list, &tcan4550_buses);
 
-	// according to spec we need to wait at least 700us for chip to become ready
-	usleep_range(700, 1000);
+	mutex_unlock(&tcan4550_buses_lock);
+
+	return bus;
 }
 
-static void tcan4550_configure_control_modes(struct net_device *dev)
+static void tcan4550_bus_put(struct tcan4550_bus *bus)
 {
-	struct tcan4550_priv *priv = netdev_priv(dev);
-	uint32_t cccr = spi_read32(priv->spi, CCCR);
-	uint32_t test = spi_read32(priv->spi, TEST);
+	mutex_lock(&tcan4550_buses_lock);
+
+	bus->refs--;
+	if (bus->refs == 0) {
+		list_del(&bus->list);
+		destroy_workqueue(bus->wq);
+		mutex_destroy(&bus->lock);
+		kfree(bus);
+	}
 
-	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK) {
-		cccr |= TEST_EN | MON;
-		test |= LBCK;
+	mutex_unlock(&tcan4550_buses_lock);
+}
+
+// initialize chip and add it to the chips serviced by the bus coordinator.
+// The interrupt line is requested by the first chip using it.
+static int tcan4550_bus_attach(struct tcan4550_priv *priv)
+{
+	struct tcan4550_bus *bus = priv->bus;
+	struct tcan4550_irq_line *line = NULL;
+	int irq = priv->spi->irq;
+	int slot = -1;
+	int err;
+	int i;
+
+	mutex_lock(&tcan4550_buses_lock);
+
+	// find line already in use by another chip or else a free line
+	for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+		if ((bus->irqs[i].users > 0) && (bus->irqs[i].irq == irq)) {
+			line = &bus->irqs[i];
+			break;
+		}
+		if (!line && (bus->irqs[i].users == 0)) {
+			line = &bus->irqs[i];
+		}
 	}
 
-	if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY) {
-		cccr |= MON;
+	mutex_lock(&bus->lock);
+
+	for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+		if (!bus->chips[i]) {
+			slot = i;
+			break;
+		}
 	}
 
-	if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT) {
-		cccr |= DAR;
+	if (!line || (slot < 0)) {
+		mutex_unlock(&bus->lock);
+		mutex_unlock(&tcan4550_buses_lock);
+		dev_err(priv->dev, "too many chips on SPI bus\n");
+		return -EBUSY;
 	}
 
-	cccr &= ~CSR; // clock stop should never be written 1 to even if reading returns 1
+	// chip is initialized with the bus locked so that a handler already
+	// running on a shared interrupt line only sees the chip when it is ready
+	tcan4550_init(priv->ndev);
+	tcan4550_clear_sw_buffers(priv);
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	bus->chips[slot] = priv;
 
-	spi_write32(priv->spi, CCCR, cccr);
-	spi_write32(priv->spi, TEST, test);
+	mutex_unlock(&bus->lock);
+
+	if (line->users == 0) {
+		// as SPI is slow, run as threaded irq in one-shot mode (hw interrupt
+		// is disabled when running irq thread function)
+		err = request_threaded_irq(irq, NULL, tcan4550_handle_interrupts,
+					   IRQF_ONESHOT, KBUILD_MODNAME, bus);
+		if (err) {
+			mutex_lock(&bus->lock);
+			spi_write32(priv->spi, ILE, 0);
+			bus->chips[slot] = NULL;
+			mutex_unlock(&bus->lock);
+
+			mutex_unlock(&tcan4550_buses_lock);
+
+			return err;
+		}
+
+		line->irq = irq;
+	}
+	line->users++;
+
+	mutex_unlock(&tcan4550_buses_lock);
+
+	return 0;
 }
 
-// initialize TCAN4550 hardware
-static void tcan4550_init(struct net_device *dev)
+// remove chip from the bus coordinator and put it in standby mode. The
+// interrupt line is freed by the last chip using it.
+static void tcan4550_bus_detach(struct tcan4550_priv *priv)
 {
-	struct tcan4550_priv *priv = netdev_priv(dev);
-	const struct can_bittiming *bt = &priv->can.bittiming;
-	uint32_t bitRateReg = (bt->phase_seg2 - 1) +
-				  ((bt->prop_seg + bt->phase_seg1 - 1) << 8) +
-				  ((bt->brp - 1) << 16) + ((bt->sjw - 1) << 25);
+	struct tcan4550_bus *bus = priv->bus;
+	int irq = priv->spi->irq;
+	int i;
+
+	mutex_lock(&tcan4550_buses_lock);
+
+	mutex_lock(&bus->lock);
+
+	for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+		if (bus->chips[i] == priv) {
+			bus->chips[i] = NULL;
+		}
+	}
 
+	// release interrupt line so the chip does not keep a shared line asserted
+	spi_write32(priv->spi, ILE, 0);
 	tcan4550_set_standby_mode(priv->spi);
-	tcan4550_unlock(priv->spi);
-	tcan4550_set_bit_rate(priv->spi, bitRateReg);
-	tcan4550_configure_mram(priv->spi);
-	tcan4550_configure_control_modes(dev);
-	tcan4550_setup_interrupts(priv->spi);
 
-	// after this call, the TCAN chip is ready to send/receive messages
-	tcan4550_set_normal_mode(priv->spi);
+	mutex_unlock(&bus->lock);
+
+	// free_irq waits for a running handler so bus lock must not be held here
+	for (i = 0; i < MAX_CHIPS_PER_BUS; i++) {
+		if ((bus->irqs[i].users > 0) && (bus->irqs[i].irq == irq)) {
+			bus->irqs[i].users--;
+			if (bus->irqs[i].users == 0) {
+				free_irq(irq, bus);
+			}
+			break;
+		}
+	}
+
+	mutex_unlock(&tcan4550_buses_lock);
 }
 
 /*------------------------------------------------------------*/
@@ -982,15 +2936,8 @@ static int tcan_open(struct net_device *ndev)
 		return err;
 	}
 
-	tcan4550_init(ndev);
-	tcan4550_clear_sw_buffers(priv);
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
-
-	// start interrupt handler, as SPI is slow, run as threaded irq in one-shot
-	// mode (hw interrupt is disabled when running irq thread function)
-	err = request_threaded_irq(priv->spi->irq, NULL,
-				   tcan4550_handle_interrupts, IRQF_ONESHOT,
-				   ndev->name, ndev);
+	// initialize chip and start interrupt handler
+	err = tcan4550_bus_attach(priv);
 	if (err) {
 		netdev_err(ndev, "failed to register interrupt\n");
 
@@ -999,9 +2946,14 @@ static int tcan_open(struct net_device *ndev)
 		return err;
 	}
 
+	tcan4550_ptp_start(priv);
+	queue_delayed_work(priv->wq, &priv->health_work,
+			   msecs_to_jiffies(HEALTH_CHECK_INTERVAL_MS));
+
 	dev_info(priv->dev, "hw rx buffers %d\n", RX_FIFO_SIZE);
 	dev_info(priv->dev, "hw tx buffers %d\n", TX_FIFO_SIZE);
 	dev_info(priv->dev, "max rx SPI burst %d\n", MAX_SPI_BURST_RX_MESSAGES);
+	dev_info(priv->dev, "rx SPI pipeline depth %d\n", RX_PIPELINE_DEPTH);
 	dev_info(priv->dev, "max tx SPI burst %d\n", MAX_SPI_BURST_TX_MESSAGES);
 
 	napi_enable(&priv->napi);
@@ -1019,8 +2971,14 @@ static int tcan_close(struct net_device *dev)
 	netif_stop_queue(dev);
 	napi_disable(&priv->napi);
 
-	free_irq(priv->spi->irq, dev);
-	tcan4550_set_standby_mode(priv->spi);
+	tcan4550_ptp_stop(priv);
+	cancel_delayed_work_sync(&priv->health_work);
+	cancel_work_sync(&priv->rx_work);
+	// the work queue is shared by all chips on the bus, so work of this chip
+	// must not run after it has been detached
+	cancel_work_sync(&priv->restart_work);
+	cancel_work_sync(&priv->tx_work);
+	tcan4550_bus_detach(priv);
 	close_candev(dev);
 
 	priv->can.state = CAN_STATE_STOPPED;
@@ -1060,6 +3018,7 @@ static netdev_tx_t tcan_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	}
 
 	priv->tx_skb_buf[priv->tx_skb_buf_head] = skb;
+	priv->tx_skb_ts[priv->tx_skb_buf_head] = ktime_get_ns();
 	priv->tx_skb_buf_head = tmpHead;
 
 	// check if queue can hold one more item, if not - stop queue
@@ -1076,17 +3035,48 @@ static netdev_tx_t tcan_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	return NETDEV_TX_OK;
 }
 
+// fetch msgs left in hw rx fifo when the sw rx buffer was full (backpressure)
+static void tcan4550_rx_work_handler(struct work_struct *ws)
+{
+	struct tcan4550_priv *priv = container_of(ws, struct tcan4550_priv, rx_work);
+
+	mutex_lock(&priv->bus->lock);
+	if (!priv->chip_lost) {
+		tcan4550_rec_msgs(priv->ndev);
+	}
+	mutex_unlock(&priv->bus->lock);
+
+	local_bh_disable();
+	napi_schedule(&priv->napi);
+	local_bh_enable();
+}
+
 // restart controller after bus off
 static void tcan4550_restart_work_handler(struct work_struct *ws)
 {
 	struct tcan4550_priv *priv = container_of(ws, struct tcan4550_priv, restart_work);
 
+	mutex_lock(&priv->bus->lock);
+
+	// restart timer of the CAN core might fire while the interface is being
+	// closed, do not re-enable the interrupt line of a detached chip
+	if (!netif_running(priv->ndev)) {
+		mutex_unlock(&priv->bus->lock);
+		return;
+	}
+
 	tcan4550_clear_sw_buffers(priv);
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
 	// NOTE! when this call returns we will get interrupts again so be very
 	// careful what is done after this call
 	tcan4550_init(priv->ndev);
+
+	mutex_unlock(&priv->bus->lock);
+
+	// timestamp counter was stopped while the controller was in init mode
+	tcan4550_ptp_resync(priv);
+
 	netif_wake_queue(priv->ndev);
 }
 
@@ -1108,6 +3098,197 @@ static int tcan4550_set_mode(struct net_device *dev, enum can_mode mode)
 	return 0;
 }
 
+/*------------------------------------------------------------*/
+/* Sysfs attributes                                           */
+/*------------------------------------------------------------*/
+
+// list rx rate limits, one per line: first id, last id, rate (msgs/s), burst
+// (msgs), dropped msgs and if the limit is currently dropping msgs
+static ssize_t rx_rate_limits_show(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	struct tcan4550_priv *priv = netdev_priv(to_net_dev(d));
+	unsigned long flags;
+	ssize_t len = 0;
+	uint32_t i;
+
+	spin_lock_irqsave(&priv->rx_rate_lock, flags);
+
+	for (i = 0; i < priv->rx_rate_limits_num; i++) {
+		struct tcan4550_rate_limit *rl = &priv->rx_rate_limits[i];
+		int digits = (rl->first & CAN_EFF_FLAG) ? 8 : 3;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%0*x-%0*x %u %u dropped %llu%s\n",
+				 digits, rl->first & CAN_EFF_MASK,
+				 digits, rl->last & CAN_EFF_MASK,
+				 rl->rate, rl->burst, rl->dropped,
+				 rl->storm ? " storm" : "");
+	}
+
+	spin_unlock_irqrestore(&priv->rx_rate_lock, flags);
+
+	return len;
+}
+
+// add or replace a limit: "<id>[-<id>] <rate> <burst>"
+// remove a limit: "del <id>[-<id>]"
+// remove all limits: "clear"
+// ids are hex, 8 digits gives an extended id (like candump)
+static ssize_t rx_rate_limits_store(struct device *d,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct tcan4550_priv *priv = netdev_priv(to_net_dev(d));
+	struct tcan4550_rate_limit *rl = NULL;
+	char ids[32];
+	canid_t first, last;
+	uint32_t rate, burst;
+	unsigned long flags;
+	bool del = false;
+	uint32_t i;
+	int ret;
+
+	if (sysfs_streq(buf, "clear")) {
+		spin_lock_irqsave(&priv->rx_rate_lock, flags);
+		WRITE_ONCE(priv->rx_rate_limits_num, 0);
+		spin_unlock_irqrestore(&priv->rx_rate_lock, flags);
+
+		return count;
+	}
+
+	if (sscanf(buf, "del %31s", ids) == 1) {
+		del = true;
+	} else if ((sscanf(buf, "%31s %u %u", ids, &rate, &burst) != 3) ||
+		   (burst == 0)) {
+		return -EINVAL;
+	}
+
+	ret = tcan4550_parse_can_id_range(ids, &first, &last);
+	if (ret) {
+		return ret;
+	}
+
+	spin_lock_irqsave(&priv->rx_rate_lock, flags);
+
+	for (i = 0; i < priv->rx_rate_limits_num; i++) {
+		if ((priv->rx_rate_limits[i].first == first) &&
+		    (priv->rx_rate_limits[i].last == last)) {
+			rl = &priv->rx_rate_limits[i];
+			break;
+		}
+	}
+
+	if (del) {
+		if (rl) {
+			// keep limits packed
+			*rl = priv->rx_rate_limits[priv->rx_rate_limits_num - 1];
+			WRITE_ONCE(priv->rx_rate_limits_num,
+				   priv->rx_rate_limits_num - 1);
+		} else {
+			ret = -ENOENT;
+		}
+	} else {
+		if (!rl && (priv->rx_rate_limits_num < MAX_RX_RATE_LIMITS)) {
+			rl = &priv->rx_rate_limits[priv->rx_rate_limits_num];
+			WRITE_ONCE(priv->rx_rate_limits_num,
+				   priv->rx_rate_limits_num + 1);
+		}
+
+		if (rl) {
+			rl->first = first;
+			rl->last = last;
+			rl->rate = rate;
+			rl->burst = burst;
+			rl->tokens = (uint64_t)burst * NSEC_PER_SEC; // start with full bucket
+			rl->last_ns = ktime_get_ns();
+			rl->dropped = 0;
+			rl->storm = false;
+		} else {
+			ret = -ENOSPC;
+		}
+	}
+
+	spin_unlock_irqrestore(&priv->rx_rate_lock, flags);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(rx_rate_limits);
+
+// number of recoveries after chip reset or brown out and outage durations
+static ssize_t health_show(struct device *d, struct device_attribute *attr,
+			   char *buf)
+{
+	struct tcan4550_priv *priv = netdev_priv(to_net_dev(d));
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "recoveries %u\nlast_outage_us %llu\nmax_outage_us %llu\nchip_lost %d\n",
+			 priv->health_recoveries,
+			 div_u64(priv->health_last_outage_ns, NSEC_PER_USEC),
+			 div_u64(priv->health_max_outage_ns, NSEC_PER_USEC),
+			 priv->chip_lost);
+}
+static DEVICE_ATTR_RO(health);
+
+static ssize_t rx_overload_policy_show(struct device *d,
+				       struct device_attribute *attr, char *buf)
+{
+	struct tcan4550_priv *priv = netdev_priv(to_net_dev(d));
+
+	return scnprintf(buf, PAGE_SIZE, "%s\n",
+			 tcan4550_overload_policy_names[priv->rx_overload_policy]);
+}
+
+// policy configures the hw rx fifo so it can only be changed when the
+// interface is down, like bitrate
+static ssize_t rx_overload_policy_store(struct device *d,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct net_device *ndev = to_net_dev(d);
+	struct tcan4550_priv *priv = netdev_priv(ndev);
+	int policy = sysfs_match_string(tcan4550_overload_policy_names, buf);
+
+	if (policy < 0) {
+		return policy;
+	}
+
+	if (netif_running(ndev)) {
+		return -EBUSY;
+	}
+
+	priv->rx_overload_policy = policy;
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_overload_policy);
+
+static ssize_t rx_overload_stats_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	struct tcan4550_priv *priv = netdev_priv(to_net_dev(d));
+	struct tcan4550_overload_stats *st = &priv->rx_overload_stats;
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "sw_dropped_newest %llu\nsw_dropped_oldest %llu\nhw_lost %llu\nhw_full %llu\nhw_overwritten %llu\nbackpressure_stalls %llu\n",
+			 st->sw_dropped_newest, st->sw_dropped_oldest,
+			 st->hw_lost, st->hw_full, st->hw_overwritten,
+			 st->backpressure_stalls);
+}
+static DEVICE_ATTR_RO(rx_overload_stats);
+
+static struct attribute *tcan4550_sysfs_attrs[] = {
+	&dev_attr_rx_rate_limits.attr,
+	&dev_attr_health.attr,
+	&dev_attr_rx_overload_policy.attr,
+	&dev_attr_rx_overload_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group tcan4550_sysfs_group = {
+	.attrs = tcan4550_sysfs_attrs,
+};
+
 static const struct net_device_ops m_can_netdev_ops = {
 	.ndo_open = tcan_open,
 	.ndo_stop = tcan_close,
@@ -1120,7 +3301,7 @@ static const struct net_device_ops m_can_netdev_ops = {
 static int tcan_probe(struct spi_device *spi)
 {
 	struct net_device *ndev;
-	int err;
+	int err, i;
 	struct tcan4550_priv *priv;
 	struct spi_delay delay = { .unit = SPI_DELAY_UNIT_USECS, .value = 0 };
 
@@ -1137,6 +3318,18 @@ static int tcan_probe(struct spi_device *spi)
 	priv->dev = &spi->dev;
 	priv->ndev = ndev;
 	priv->spi = spi;
+
+	priv->bufs = devm_kzalloc(&spi->dev, sizeof(*priv->bufs), GFP_KERNEL);
+	if (!priv->bufs) {
+		dev_err(&spi->dev, "could not allocate SPI buffers\n");
+		err = -ENOMEM;
+		goto exit_free;
+	}
+
+	for (i = 0; i < RX_PIPELINE_DEPTH; i++) {
+		init_completion(&priv->bufs->rxBurst[i].done);
+	}
+
 	priv->can.bittiming_const = &tcan4550_bittiming_const;
 	priv->can.clock.freq = 40000000;
 	priv->can.do_set_mode = tcan4550_set_mode;
@@ -1146,6 +3339,8 @@ static int tcan_probe(struct spi_device *spi)
 					   CAN_CTRLMODE_ONE_SHOT;
 
 	ndev->netdev_ops = &m_can_netdev_ops;
+	ndev->ethtool_ops = &tcan4550_ethtool_ops;
+	ndev->sysfs_groups[0] = &tcan4550_sysfs_group;
 
 	// Tell Linux we support local echo
 	ndev->flags |= IFF_ECHO;
@@ -1163,6 +3358,7 @@ static int tcan_probe(struct spi_device *spi)
 
 	spin_lock_init(&priv->tx_skb_lock);
 	spin_lock_init(&priv->rx_skb_lock);
+	spin_lock_init(&priv->rx_rate_lock);
 	mutex_init(&priv->spi_lock);
 
 	err = spi_setup(spi);
@@ -1194,14 +3390,20 @@ static int tcan_probe(struct spi_device *spi)
 		goto exit_unregister;
 	}
 
-	priv->wq = alloc_workqueue("tcan4550_wq", WQ_FREEZABLE | WQ_MEM_RECLAIM, 1);
-	if (!priv->wq) {
-		dev_err(&spi->dev, "could not allocate workqueue\n");
+	// chips on the same SPI controller share bus coordinator and work queue
+	priv->bus = tcan4550_bus_get(spi);
+	if (!priv->bus) {
+		dev_err(&spi->dev, "could not allocate SPI bus coordinator\n");
 		err = -ENOMEM;
 		goto exit_unregister;
 	}
+	priv->wq = priv->bus->wq;
 	INIT_WORK(&priv->tx_work, tcan4550_tx_work_handler);
 	INIT_WORK(&priv->restart_work, tcan4550_restart_work_handler);
+	INIT_WORK(&priv->rx_work, tcan4550_rx_work_handler);
+	INIT_DELAYED_WORK(&priv->health_work, tcan4550_health_work_handler);
+
+	tcan4550_ptp_register(priv);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
 	netif_napi_add_weight(priv->ndev, &(priv->napi), tcan4550_poll, NAPI_BUDGET);
@@ -1209,6 +3411,13 @@ static int tcan_probe(struct spi_device *spi)
 	netif_napi_add(priv->ndev, &(priv->napi), tcan4550_poll, NAPI_BUDGET);
 #endif
 
+	tcan4550_debugfs_init(priv);
+
+	// tx ring is optional, the interface works without it
+	if (tcan4550_txring_register(priv)) {
+		dev_warn(&spi->dev, "could not register tx ring\n");
+	}
+
 	dev_info(&spi->dev, "device registered\n");
 
 	return 0;
@@ -1230,10 +3439,22 @@ void tcan_remove(struct spi_device *spi)
 	struct net_device *ndev = spi_get_drvdata(spi);
 	struct tcan4550_priv *priv = netdev_priv(ndev);
 
+	debugfs_remove_recursive(priv->debugfs);
 	unregister_candev(ndev);
-	free_candev(ndev);
-	destroy_workqueue(priv->wq);
+	tcan4550_ptp_unregister(priv);
+
+	// before the works are cancelled so open files cannot queue tx work
+	tcan4550_txring_unregister(priv);
+
+	// work queue is shared with other chips on the bus, only cancel our work
+	cancel_work_sync(&priv->tx_work);
+	cancel_work_sync(&priv->restart_work);
+	cancel_work_sync(&priv->rx_work);
+	cancel_delayed_work_sync(&priv->health_work);
 	netif_napi_del(&priv->napi);
+	tcan4550_bus_put(priv->bus);
+
+	free_candev(ndev);
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(5, 18, 0)
 	return 0;
@@ -1269,8 +3490,13 @@ static __maybe_unused int tcan4550_resume(struct device *dev)
 	priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
 	if (netif_running(ndev)) {
+		mutex_lock(&priv->bus->lock);
 		tcan4550_hw_reset(ndev);
 		tcan4550_init(ndev);
+		mutex_unlock(&priv->bus->lock);
+
+		// timestamp counter was reset with the chip
+		tcan4550_ptp_resync(priv);
 
 		netif_device_attach(ndev);
 		netif_start_queue(ndev);
@@ -1317,7 +3543,28 @@ static struct spi_driver tcan4550_can_driver = {
 	.probe = tcan_probe,
 	.remove = tcan_remove,
 };
-module_spi_driver(tcan4550_can_driver);
+
+static int __init tcan4550_module_init(void)
+{
+	int err;
+
+	tcan4550_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	err = spi_register_driver(&tcan4550_can_driver);
+	if (err) {
+		debugfs_remove_recursive(tcan4550_debugfs_root);
+	}
+
+	return err;
+}
+module_init(tcan4550_module_init);
+
+static void __exit tcan4550_module_exit(void)
+{
+	spi_unregister_driver(&tcan4550_can_driver);
+	debugfs_remove_recursive(tcan4550_debugfs_root);
+}
+module_exit(tcan4550_module_exit);
 
 MODULE_AUTHOR("Carl-Magnus Moon");
 MODULE_LICENSE("GPL v2");
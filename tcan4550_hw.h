@@ -0,0 +1,383 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+// TCAN4550 register definitions, message RAM layout and element codec.
+// Shared by the kernel driver and the user space polled mode driver, so it
+// must only depend on headers available in both.
+// Copyright (C) 2023 CrossControl
+
+#ifndef TCAN4550_HW_H
+#define TCAN4550_HW_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#endif
+#include <linux/can.h>
+
+// TCAN4550 Registers
+static const uint32_t DEVICE_ID1 = 0x0;
+static const uint32_t DEVICE_ID2 = 0x4;
+static const uint32_t STATUS = 0x0C;
+static const uint32_t SPI_MASK = 0x10;
+
+static const uint32_t MODES_OF_OPERATION = 0x0800;
+static const uint32_t INTERRUPT_FLAGS = 0x0820;
+static const uint32_t INTERRUPT_ENABLE = 0x0830;
+
+static const uint32_t TEST = 0x1010; // test register
+static const uint32_t CCCR = 0x1018; // cc control register
+static const uint32_t NBTP = 0x101C; // nominal bit timing & prescaler register
+static const uint32_t TSCC = 0x1020; // timestamp counter configuration
+static const uint32_t TSCV = 0x1024; // timestamp counter value
+static const uint32_t ECR = 0x1040; // error counter register
+static const uint32_t PSR = 0x1044; // protocol status register
+static const uint32_t IR = 0x1050; // interrupt register
+static const uint32_t IE = 0x1054; // interrupt enable
+static const uint32_t ILE = 0x105C; // interrupt line enable
+static const uint32_t RXF0C = 0x10A0; // rx FIFO 0 configuration
+static const uint32_t RXF0S = 0x10A4; // rx FIFO 0 status
+static const uint32_t RXF0A = 0x10A8; // rx FIFO 0 acknowledge
+static const uint32_t TXBC = 0x10C0; // tx buffer configuration
+static const uint32_t TXESC = 0x10C8; // tx buffer element size configuration
+static const uint32_t RXESC = 0x10BC; // rx buffer element size configuration
+static const uint32_t TXQFS = 0x10C4; // tx FIFO/queue status
+static const uint32_t TXBAR = 0x10D0; // tx buffer add request
+static const uint32_t TXBTO = 0x10D8; // tx buffer transmission occurred
+static const uint32_t TXBTIE = 0x10E0; // tx buffer transmission interrupt enable
+static const uint32_t TXEFC = 0x10F0; // tx event fifo configuration
+static const uint32_t TXEFS = 0x10F4; // tx event fifo status
+static const uint32_t TXEFA = 0x10F8; // tx event fifo acknowledge
+
+static const uint32_t TX_8_BYTES = 0; // tx message length
+static const uint32_t RX_8_BYTES = 0; // rx message length
+
+static const uint32_t RF0N = (0x1UL << 0); // rx fifo 0 new data
+static const uint32_t RF0F = (0x1UL << 2); // rx fifo 0 full
+static const uint32_t RF0LE = (0x1UL << 3); // rx fifo 0 message lost
+static const uint32_t TC = (0x1UL << 9); // transmission complete
+static const uint32_t TFE = (0x1UL << 11); // transmit fifo empty
+static const uint32_t TEFN = (0x1UL << 12); // tx event fifo new entry
+static const uint32_t TEFW = (0x1UL << 13); // event fifo watermark
+static const uint32_t EP = (0x1UL << 23); // error passive
+static const uint32_t EW = (0x1UL << 24); // error warning
+static const uint32_t BO = (0x1UL << 25); // bus off
+
+static const uint32_t PWRON = (0x1UL << 20); // power on interrupt flag
+
+static const uint32_t F0OM = (0x1UL << 31); // rx fifo 0 overwrite mode
+
+static const uint32_t EFC = (0x1UL << 23); // tx element T1: store tx event
+
+static const uint32_t INIT = (0x1UL << 0); // init
+static const uint32_t CCE = (0x1UL << 1); // configuration change enable
+static const uint32_t CSR = (0x1UL << 4); // clock stop request
+static const uint32_t MON = (0x1UL << 5); // bus monitoring mode
+static const uint32_t DAR = (0x1UL << 6); // disable automatic retransmission
+static const uint32_t TEST_EN = (0x1UL << 7); // test mode
+
+static const uint32_t MODESEL_1 = (0x1UL << 6);
+static const uint32_t MODESEL_2 = (0x1UL << 7);
+
+static const uint32_t LBCK = (0x1UL << 4); // loopback mode
+
+static const uint32_t TSS_INTERNAL = (0x1UL << 0); // timestamp counter incremented according to TCP
+
+static const uint32_t ERROR_PASSIVE = (0x1UL << 5);
+static const uint32_t ERROR_WARNING = (0x1UL << 6);
+static const uint32_t BUS_OFF = (0x1UL << 7);
+
+static const uint32_t TCAN_EXTENDED_FLAG = (0x1UL << 30);
+
+// Message RAM (MRAM) constants. Do not change.
+static const uint32_t MRAM_BASE = 0x8000;
+static const uint32_t MRAM_SIZE_WORDS = 0x200;
+
+// Identifiers for TCAN4550 chip. TCAN4550 in ascii.
+static const uint32_t TCAN_ID = 0x4E414354;
+static const uint32_t TCAN_ID2 = 0x30353534;
+
+// Message RAM (MRAM) config. User adjustable.
+static const uint32_t RX_SLOT_SIZE = 16; // size of one element in the rx fifo
+static const uint32_t TX_SLOT_SIZE = 16; // size of one element in the tx fifo
+static const uint32_t TX_FIFO_SIZE = 32; // possible values = 0 - 32
+static const uint32_t TX_FIFO_START_ADDRESS = 0x0; // position in MRAM where tx fifo start (excluding MRAM base address)
+static const uint32_t RX_FIFO_SIZE = 64; // possible values = 0 - 64
+static const uint32_t RX_FIFO_START_ADDRESS = 0x200; // position in MRAM where rx fifo start (excluding MRAM base address)
+static const uint32_t EVENT_SLOT_SIZE = 8; // size of one element in the tx event fifo
+static const uint32_t EVENT_FIFO_START_ADDRESS = 0x600; // position in MRAM where tx event fifo start (excluding MRAM base address)
+static const uint32_t EVENT_FIFO_SIZE = 32; // elements in the event FIFO, possible values = 0 - 32
+static const uint32_t EVENT_FIFO_WATERMARK = 0; // watermark level to generate interrupt
+
+static const uint32_t SPI_READ_COMMAND = 0x41;
+static const uint32_t SPI_WRITE_COMMAND = 0x61;
+
+/*------------------------------------------------------------*/
+/* Register values                                            */
+/*------------------------------------------------------------*/
+
+// nominal bit timing register, tseg1 = prop_seg + phase_seg1, tseg2 = phase_seg2
+static inline uint32_t tcan4550_nbtp(uint32_t brp, uint32_t tseg1,
+				     uint32_t tseg2, uint32_t sjw)
+{
+	return (tseg2 - 1) + ((tseg1 - 1) << 8) + ((brp - 1) << 16) +
+	       ((sjw - 1) << 25);
+}
+
+// timestamp counter counts CAN bit times / prescaler (1 - 16)
+static inline uint32_t tcan4550_tscc(uint32_t prescaler)
+{
+	return TSS_INTERNAL + ((prescaler - 1) << 16);
+}
+
+static inline uint32_t tcan4550_txbc(void)
+{
+	return TX_FIFO_START_ADDRESS + (TX_FIFO_SIZE << 24);
+}
+
+// in overwrite mode new msgs overwrite the oldest msg when fifo is full, else
+// new msgs are lost
+static inline uint32_t tcan4550_rxf0c(bool rxOverwrite)
+{
+	return RX_FIFO_START_ADDRESS + (RX_FIFO_SIZE << 16) +
+	       (rxOverwrite ? F0OM : 0);
+}
+
+static inline uint32_t tcan4550_txefc(void)
+{
+	return EVENT_FIFO_START_ADDRESS + (EVENT_FIFO_SIZE << 16) +
+	       (EVENT_FIFO_WATERMARK << 24);
+}
+
+static inline uint32_t tcan4550_modes_standby(uint32_t modes)
+{
+	return (modes | MODESEL_1) & ~((uint32_t)MODESEL_2);
+}
+
+static inline uint32_t tcan4550_modes_normal(uint32_t modes)
+{
+	return (modes | MODESEL_2) & ~((uint32_t)MODESEL_1);
+}
+
+// set CCE and INIT bits, clear CSR
+static inline uint32_t tcan4550_cccr_unlock(uint32_t cccr)
+{
+	return (cccr | CCE | INIT) & ~((uint32_t)CSR);
+}
+
+/*------------------------------------------------------------*/
+/* Message RAM layout                                         */
+/*------------------------------------------------------------*/
+
+// SPI address of element index in rx fifo 0
+static inline uint32_t tcan4550_rx_elem_address(uint32_t index)
+{
+	return MRAM_BASE + RX_FIFO_START_ADDRESS + (index * RX_SLOT_SIZE);
+}
+
+// SPI address of element index in tx fifo
+static inline uint32_t tcan4550_tx_elem_address(uint32_t index)
+{
+	return MRAM_BASE + TX_FIFO_START_ADDRESS + (index * TX_SLOT_SIZE);
+}
+
+// SPI address of element index in tx event fifo
+static inline uint32_t tcan4550_event_elem_address(uint32_t index)
+{
+	return MRAM_BASE + EVENT_FIFO_START_ADDRESS + (index * EVENT_SLOT_SIZE);
+}
+
+// msgs in rx fifo 0, 0 - 64
+static inline uint32_t tcan4550_rxf0s_fill_level(uint32_t rxf0s)
+{
+	return ((rxf0s & 0x7F) < 64) ? (rxf0s & 0x7F) : 64;
+}
+
+// index of oldest msg in rx fifo 0, 0 - 63
+static inline uint32_t tcan4550_rxf0s_get_index(uint32_t rxf0s)
+{
+	return (rxf0s >> 8) & 0x3F;
+}
+
+// Rx fifo 0 in overwrite mode (F0OM). A msg arriving while the fifo is full
+// overwrites the msg at the get index and advances the get index, so a read
+// cannot acknowledge a get index taken before it. The read sequence is:
+// skip the msg at the get index of a full fifo, read without acknowledge,
+// read RXF0S again, drop the stale msgs and acknowledge forward only.
+
+// msgs to skip at the get index before reading, 0 or 1. The msg at the get
+// index of a full fifo is the next one to be overwritten.
+static inline uint32_t tcan4550_rx_overwrite_skip(uint32_t fillLevel)
+{
+	return (fillLevel == RX_FIFO_SIZE) ? 1 : 0;
+}
+
+// msgs from firstIndex, the get index before the read, that the get index
+// read after the read has moved past. They may have been overwritten while
+// being read and are dropped. Includes the skipped msg, which is lost either
+// way.
+static inline uint32_t tcan4550_rx_overwrite_stale(uint32_t firstIndex,
+						   uint32_t getIndex,
+						   uint32_t skipped,
+						   uint32_t msgsRead)
+{
+	uint32_t stale = (getIndex + RX_FIFO_SIZE - firstIndex) % RX_FIFO_SIZE;
+
+	if (stale < skipped) {
+		stale = skipped;
+	}
+	if (stale > skipped + msgsRead) {
+		stale = skipped + msgsRead;
+	}
+
+	return stale;
+}
+
+// index to write to RXF0A after the read in ack. Returns false if all msgs
+// read are stale, as an acknowledge behind the hw get index would move it
+// backwards.
+static inline bool tcan4550_rx_overwrite_ack(uint32_t firstIndex,
+					     uint32_t stale, uint32_t skipped,
+					     uint32_t msgsRead, uint32_t *ack)
+{
+	if (stale >= skipped + msgsRead) {
+		return false;
+	}
+
+	*ack = (firstIndex + skipped + msgsRead - 1) % RX_FIFO_SIZE;
+
+	return true;
+}
+
+// free elements in tx fifo
+static inline uint32_t tcan4550_txqfs_free_level(uint32_t txqfs)
+{
+	return txqfs & 0x3F;
+}
+
+// index of next free element in tx fifo
+static inline uint32_t tcan4550_txqfs_put_index(uint32_t txqfs)
+{
+	return (txqfs >> 16) & 0x1F;
+}
+
+// events in tx event fifo, 0 - 32
+static inline uint32_t tcan4550_txefs_fill_level(uint32_t txefs)
+{
+	return ((txefs & 0x3F) < 32) ? (txefs & 0x3F) : 32;
+}
+
+// index of oldest event in tx event fifo, 0 - 31
+static inline uint32_t tcan4550_txefs_get_index(uint32_t txefs)
+{
+	return (txefs >> 8) & 0x1F;
+}
+
+// tx element T1 bits storing a tx event with message marker marker when the
+// msg has been transmitted
+static inline uint32_t tcan4550_tx_event_marker(uint32_t marker)
+{
+	return EFC + ((marker & 0xFF) << 24);
+}
+
+// message marker of tx event element word E1
+static inline uint32_t tcan4550_tx_event_mm(uint32_t e1)
+{
+	return e1 >> 24;
+}
+
+// timestamp counter value at the start of frame of tx event element word E1
+static inline uint32_t tcan4550_tx_event_timestamp(uint32_t e1)
+{
+	return e1 & 0xFFFF;
+}
+
+// bits of the classic CAN frame of tx event element words E0 and E1 from
+// start of frame to the end of the end of frame field, without stuff bits
+static inline uint32_t tcan4550_tx_event_frame_bits(uint32_t e0, uint32_t e1)
+{
+	bool extended = (e0 & TCAN_EXTENDED_FLAG) ? true : false;
+	bool rtr = (e0 & (0x1UL << 29)) ? true : false;
+	uint32_t dlc = (e1 >> 16) & 0xF;
+	uint32_t len = rtr ? 0 : ((dlc <= 8) ? dlc : 8);
+
+	// 19 (extended 39) bits arbitration and control field, 25 bits crc,
+	// ack and end of frame fields
+	return (extended ? 64 : 44) + (len * 8);
+}
+
+/*------------------------------------------------------------*/
+/* Element codec                                              */
+/*------------------------------------------------------------*/
+
+// convert a CAN frame to a tcan4550 tx element and store in buffer
+static inline void tcan4550_can_frame_to_tcan_msg(const struct can_frame *frame,
+						  uint32_t *buffer)
+{
+	bool extended = (frame->can_id & CAN_EFF_FLAG) ? true : false;
+	bool rtr = (frame->can_id & CAN_RTR_FLAG) ? true : false;
+	uint32_t len = (frame->len <= 8) ? frame->len : 8;
+	uint32_t id;
+
+	if (extended) {
+		id = frame->can_id & CAN_EFF_MASK;
+		buffer[0] = id + ((uint32_t)rtr << 29) +
+				TCAN_EXTENDED_FLAG; // add extended + rtr flag
+	} else {
+		id = frame->can_id & CAN_SFF_MASK;
+		buffer[0] = (id << 18) + ((uint32_t)rtr << 29); // add rtr flag
+	}
+
+	buffer[1] = (len << 16);
+	buffer[2] = frame->data[0] + (frame->data[1] << 8) +
+			(frame->data[2] << 16) + ((uint32_t)frame->data[3] << 24);
+	buffer[3] = frame->data[4] + (frame->data[5] << 8) +
+			(frame->data[6] << 16) + ((uint32_t)frame->data[7] << 24);
+}
+
+// get CAN id (including extended flag) from first word of a tcan4550 element
+static inline canid_t tcan4550_tcan_msg_to_can_id(uint32_t t0)
+{
+	if (t0 & TCAN_EXTENDED_FLAG) {
+		return (t0 & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	}
+
+	return (t0 >> 18) & CAN_SFF_MASK;
+}
+
+// convert a tcan4550 rx element to a CAN frame. Fields not set here must be
+// zeroed by the caller. Returns false if the element had an invalid length,
+// which is then limited to 8.
+static inline bool tcan4550_tcan_msg_to_can_frame(const uint32_t *data,
+						  struct can_frame *cf)
+{
+	bool valid = true;
+
+	cf->len = (data[1] >> 16) & 0x0F;
+
+	if (cf->len > 8) {
+		cf->len = 8;
+		valid = false;
+	}
+
+	cf->can_id = tcan4550_tcan_msg_to_can_id(data[0]);
+
+	cf->data[0] = data[2] & 0xFF;
+	cf->data[1] = (data[2] >> 8) & 0xFF;
+	cf->data[2] = (data[2] >> 16) & 0xFF;
+	cf->data[3] = (data[2] >> 24) & 0xFF;
+	cf->data[4] = data[3] & 0xFF;
+	cf->data[5] = (data[3] >> 8) & 0xFF;
+	cf->data[6] = (data[3] >> 16) & 0xFF;
+	cf->data[7] = (data[3] >> 24) & 0xFF;
+
+	return valid;
+}
+
+// rx timestamp (timestamp counter value at start of frame) of a tcan4550 rx element
+static inline uint32_t tcan4550_tcan_msg_rx_timestamp(const uint32_t *data)
+{
+	return data[1] & 0xFFFF;
+}
+
+#endif
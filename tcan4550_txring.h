@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+// Memory mapped tx ring of the TCAN4550 driver, shared with user space
+// Copyright (C) 2023 CrossControl
+
+#ifndef TCAN4550_TXRING_H
+#define TCAN4550_TXRING_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// Number of elements in the tx ring, must be a power of 2
+#define TCAN4550_TXRING_ENTRIES 1024
+
+// One CAN msg in the tx buffer element format of the chip, words in host byte
+// order:
+// data[0] (T0): bit 30 extended id, bit 29 rtr, bits 28-0 extended id or
+//               bits 28-18 standard id
+// data[1] (T1): bits 19-16 dlc
+// data[2]:      data bytes 0-3 (byte 0 in bits 7-0)
+// data[3]:      data bytes 4-7 (byte 4 in bits 7-0)
+// All other bits are cleared by the driver.
+struct tcan4550_txring_elem {
+	__u32 data[4];
+};
+
+// Ring mapped with mmap on /dev/tcan4550-<spi device>, e.g.
+// /dev/tcan4550-spi0.0. Indexes are free running, element of an index is
+// elem[index & (TCAN4550_TXRING_ENTRIES - 1)].
+//
+// User space writes elements at producer, then increments producer (with
+// release semantics) and calls ioctl TCAN4550_TXRING_KICK. The driver copies
+// runs of elements directly into SPI bursts to the tx fifo of the chip and
+// increments consumer when the elements have been handed to the chip. Poll
+// for POLLOUT to wait for free elements.
+//
+// Msgs sent through the ring are not echoed to local CAN sockets.
+struct tcan4550_txring {
+	__u32 producer; // written by user space
+	__u32 pad0[15]; // producer and consumer on separate cache lines
+	__u32 consumer; // written by driver
+	__u32 pad1[15];
+	struct tcan4550_txring_elem elem[TCAN4550_TXRING_ENTRIES];
+};
+
+// Tell driver that producer has been incremented
+#define TCAN4550_TXRING_KICK _IO(0xCA, 0x01)
+
+#endif
@@ -0,0 +1,597 @@
+// SPDX-License-Identifier: GPL-2.0
+// User space polled mode driver for TI TCAN4550
+// Copyright (C) 2023 CrossControl
+
+#include <errno.h>
+#include <string.h>
+
+#include "../tcan4550_hw.h"
+#include "tcan4550_pmd.h"
+
+/*------------------------------------------------------------*/
+/* SPI helper functions                                       */
+/*------------------------------------------------------------*/
+
+// SPI command header: command, 16-bit address, length in words
+static void spi_put_header(uint8_t *buf, uint32_t command, uint32_t address,
+			   uint32_t words)
+{
+	buf[0] = command;
+	buf[1] = address >> 8;
+	buf[2] = address & 0xFF;
+	buf[3] = words;
+}
+
+// words are sent most significant byte first
+static void spi_put_words(uint8_t *buf, const uint32_t *data, uint32_t words)
+{
+	uint32_t i;
+
+	for (i = 0; i < words; i++) {
+		buf[(i * 4) + 0] = (data[i] >> 24) & 0xFF;
+		buf[(i * 4) + 1] = (data[i] >> 16) & 0xFF;
+		buf[(i * 4) + 2] = (data[i] >> 8) & 0xFF;
+		buf[(i * 4) + 3] = data[i] & 0xFF;
+	}
+}
+
+static void spi_get_words(const uint8_t *buf, uint32_t *data, uint32_t words)
+{
+	uint32_t i;
+
+	for (i = 0; i < words; i++) {
+		data[i] = ((uint32_t)buf[(i * 4) + 0] << 24) +
+			  (buf[(i * 4) + 1] << 16) + (buf[(i * 4) + 2] << 8) +
+			  buf[(i * 4) + 3];
+	}
+}
+
+static int spi_transfer(struct tcan4550_pmd *pmd,
+			const struct tcan4550_spi_xfer *xfers, int numXfers)
+{
+	int ret = pmd->spi->transfer(pmd->spi, xfers, numXfers);
+
+	if (ret) {
+		pmd->stats.spi_errors++;
+	}
+
+	return ret;
+}
+
+int tcan4550_pmd_read32(struct tcan4550_pmd *pmd, uint32_t address,
+			uint32_t *data)
+{
+	uint8_t txBuf[8] = { 0 };
+	uint8_t rxBuf[8];
+	struct tcan4550_spi_xfer xfer = { txBuf, rxBuf, sizeof(rxBuf) };
+	int ret;
+
+	spi_put_header(txBuf, SPI_READ_COMMAND, address, 1);
+
+	ret = spi_transfer(pmd, &xfer, 1);
+	if (ret) {
+		return ret;
+	}
+
+	spi_get_words(&rxBuf[4], data, 1);
+
+	return 0;
+}
+
+int tcan4550_pmd_write32(struct tcan4550_pmd *pmd, uint32_t address,
+			 uint32_t data)
+{
+	uint8_t txBuf[8];
+	uint8_t rxBuf[8];
+	struct tcan4550_spi_xfer xfer = { txBuf, rxBuf, sizeof(txBuf) };
+
+	spi_put_header(txBuf, SPI_WRITE_COMMAND, address, 1);
+	spi_put_words(&txBuf[4], &data, 1);
+
+	return spi_transfer(pmd, &xfer, 1);
+}
+
+// read msgs elements at address and, if acknowledge, acknowledge rx fifo
+// index ack in the same SPI message. Elements are stored in pmd->elems.
+static int spi_read_msgs(struct tcan4550_pmd *pmd, uint32_t address,
+			 uint32_t msgs, bool acknowledge, uint32_t ack)
+{
+	struct tcan4550_spi_xfer xfers[2] = {
+		{ pmd->txBuf, pmd->rxBuf, 4 + (msgs * 16) },
+		{ pmd->ackTxBuf, pmd->ackRxBuf, sizeof(pmd->ackTxBuf) },
+	};
+	int ret;
+
+	memset(pmd->txBuf, 0, 4 + (msgs * 16));
+	spi_put_header(pmd->txBuf, SPI_READ_COMMAND, address, msgs * 4);
+	spi_put_header(pmd->ackTxBuf, SPI_WRITE_COMMAND, RXF0A, 1);
+	spi_put_words(&pmd->ackTxBuf[4], &ack, 1);
+
+	ret = spi_transfer(pmd, xfers, acknowledge ? 2 : 1);
+	if (ret) {
+		return ret;
+	}
+
+	spi_get_words(&pmd->rxBuf[4], pmd->elems, msgs * 4);
+
+	return 0;
+}
+
+// write msgs elements from data to address and request transmission of the
+// buffers in requestMask in one SPI message
+static int spi_write_msgs_request(struct tcan4550_pmd *pmd, uint32_t address,
+				  uint32_t msgs, const uint32_t *data,
+				  uint32_t requestMask)
+{
+	struct tcan4550_spi_xfer xfers[2] = {
+		{ pmd->txBuf, pmd->rxBuf, 4 + (msgs * 16) },
+		{ pmd->ackTxBuf, pmd->ackRxBuf, sizeof(pmd->ackTxBuf) },
+	};
+
+	spi_put_header(pmd->txBuf, SPI_WRITE_COMMAND, address, msgs * 4);
+	spi_put_words(&pmd->txBuf[4], data, msgs * 4);
+	spi_put_header(pmd->ackTxBuf, SPI_WRITE_COMMAND, TXBAR, 1);
+	spi_put_words(&pmd->ackTxBuf[4], &requestMask, 1);
+
+	return spi_transfer(pmd, xfers, 2);
+}
+
+/*------------------------------------------------------------*/
+/* TCAN4550 functions, same sequence as kernel driver         */
+/*------------------------------------------------------------*/
+
+static int tcan4550_modify(struct tcan4550_pmd *pmd, uint32_t address,
+			   uint32_t (*modify)(uint32_t))
+{
+	uint32_t val;
+	int ret;
+
+	ret = tcan4550_pmd_read32(pmd, address, &val);
+	if (ret) {
+		return ret;
+	}
+
+	return tcan4550_pmd_write32(pmd, address, modify(val));
+}
+
+static int tcan4550_read_identification(struct tcan4550_pmd *pmd)
+{
+	uint32_t id1, id2;
+	int ret;
+
+	ret = tcan4550_pmd_read32(pmd, DEVICE_ID1, &id1);
+	if (!ret) {
+		ret = tcan4550_pmd_read32(pmd, DEVICE_ID2, &id2);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	// TCAN4550 in ascii
+	if ((id1 != TCAN_ID) || (id2 != TCAN_ID2)) {
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+// clear MRAM to avoid risk of ECC errors, written in SPI bursts
+static int tcan4550_clear_mram(struct tcan4550_pmd *pmd)
+{
+	struct tcan4550_spi_xfer xfer = { pmd->txBuf, pmd->rxBuf, 0 };
+	uint32_t i, words;
+	int ret;
+
+	for (i = 0; i < MRAM_SIZE_WORDS; i += words) {
+		words = TCAN4550_PMD_MAX_BURST * 4;
+		if (words > MRAM_SIZE_WORDS - i) {
+			words = MRAM_SIZE_WORDS - i;
+		}
+
+		memset(pmd->txBuf, 0, 4 + (words * 4));
+		spi_put_header(pmd->txBuf, SPI_WRITE_COMMAND, MRAM_BASE + (i * 4),
+			       words);
+		xfer.len = 4 + (words * 4);
+
+		ret = spi_transfer(pmd, &xfer, 1);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int tcan4550_configure_mram(struct tcan4550_pmd *pmd, bool rxOverwrite)
+{
+	int ret;
+
+	ret = tcan4550_clear_mram(pmd);
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, TXBC, tcan4550_txbc());
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, RXF0C, tcan4550_rxf0c(rxOverwrite));
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, TXESC, TX_8_BYTES);
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, RXESC, RX_8_BYTES);
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, TXEFC, tcan4550_txefc());
+	}
+
+	return ret;
+}
+
+static int tcan4550_configure_control_modes(struct tcan4550_pmd *pmd,
+					    const struct tcan4550_pmd_config *cfg)
+{
+	uint32_t cccr, test;
+	int ret;
+
+	ret = tcan4550_pmd_read32(pmd, CCCR, &cccr);
+	if (!ret) {
+		ret = tcan4550_pmd_read32(pmd, TEST, &test);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	// the chip is not necessarily reset before init, clear modes of a
+	// previous configuration
+	cccr &= ~((uint32_t)(TEST_EN | MON | DAR));
+	test &= ~((uint32_t)LBCK);
+
+	if (cfg->loopback) {
+		cccr |= TEST_EN | MON;
+		test |= LBCK;
+	}
+
+	if (cfg->listen_only) {
+		cccr |= MON;
+	}
+
+	if (cfg->one_shot) {
+		cccr |= DAR;
+	}
+
+	cccr &= ~CSR; // clock stop should never be written 1 to even if reading returns 1
+
+	ret = tcan4550_pmd_write32(pmd, CCCR, cccr);
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, TEST, test);
+	}
+
+	return ret;
+}
+
+// interrupt flags are polled, the interrupt line is disabled
+static int tcan4550_setup_interrupts(struct tcan4550_pmd *pmd)
+{
+	const uint32_t regs[][2] = {
+		{ IE, RF0N + TFE + BO + EW + EP + RF0LE },
+		{ ILE, 0 },
+		{ SPI_MASK, 0xFFFFFFFF }, // mask all spi errors
+		{ STATUS, 0xFFFFFFFF }, // clear spi status register
+		{ INTERRUPT_FLAGS, 0xFFFFFFFF }, // clear interrupts
+		{ INTERRUPT_ENABLE, 0 },
+	};
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+		ret = tcan4550_pmd_write32(pmd, regs[i][0], regs[i][1]);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int tcan4550_pmd_bittiming(uint32_t bitrate, struct tcan4550_pmd_config *cfg)
+{
+	const uint32_t tq = 40; // time quanta per bit, 1 + tseg1 + tseg2
+
+	if ((bitrate == 0) || (TCAN4550_PMD_CLOCK_HZ % (bitrate * tq))) {
+		return -EINVAL;
+	}
+
+	cfg->brp = TCAN4550_PMD_CLOCK_HZ / (bitrate * tq);
+	cfg->tseg1 = 31;
+	cfg->tseg2 = 8;
+	cfg->sjw = 8;
+
+	return 0;
+}
+
+int tcan4550_pmd_init(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi,
+		      const struct tcan4550_pmd_config *cfg)
+{
+	uint32_t prescaler = cfg->ts_prescaler ? cfg->ts_prescaler : 1;
+	int ret;
+
+	memset(pmd, 0, sizeof(*pmd));
+	pmd->spi = spi;
+	pmd->rx_overwrite = cfg->rx_overwrite;
+
+	if ((cfg->brp == 0) || (cfg->tseg1 == 0) || (cfg->tseg2 == 0) ||
+	    (cfg->sjw == 0) || (prescaler > 16)) {
+		return -EINVAL;
+	}
+
+	ret = tcan4550_read_identification(pmd);
+	if (!ret) {
+		ret = tcan4550_modify(pmd, MODES_OF_OPERATION,
+				      tcan4550_modes_standby);
+	}
+	if (!ret) {
+		ret = tcan4550_modify(pmd, CCCR, tcan4550_cccr_unlock);
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, NBTP,
+					   tcan4550_nbtp(cfg->brp, cfg->tseg1,
+							 cfg->tseg2, cfg->sjw));
+	}
+	if (!ret) {
+		ret = tcan4550_pmd_write32(pmd, TSCC, tcan4550_tscc(prescaler));
+	}
+	if (!ret) {
+		ret = tcan4550_configure_mram(pmd, cfg->rx_overwrite);
+	}
+	if (!ret) {
+		ret = tcan4550_configure_control_modes(pmd, cfg);
+	}
+	if (!ret) {
+		ret = tcan4550_setup_interrupts(pmd);
+	}
+
+	// after this call, the TCAN chip is ready to send/receive messages
+	if (!ret) {
+		ret = tcan4550_modify(pmd, MODES_OF_OPERATION,
+				      tcan4550_modes_normal);
+	}
+
+	return ret;
+}
+
+int tcan4550_pmd_stop(struct tcan4550_pmd *pmd)
+{
+	return tcan4550_modify(pmd, MODES_OF_OPERATION, tcan4550_modes_standby);
+}
+
+/*------------------------------------------------------------*/
+/* Batch rx/tx                                                */
+/*------------------------------------------------------------*/
+
+// decode msgs elements in pmd->elems into frames and timestamps
+static void tcan4550_pmd_decode(struct tcan4550_pmd *pmd, uint32_t msgs,
+				struct can_frame *frames, uint32_t *timestamps)
+{
+	uint32_t i;
+
+	for (i = 0; i < msgs; i++) {
+		const uint32_t *data = &pmd->elems[i * 4];
+
+		memset(&frames[i], 0, sizeof(frames[i]));
+		if (!tcan4550_tcan_msg_to_can_frame(data, &frames[i])) {
+			pmd->stats.rx_invalid++;
+		}
+
+		if (timestamps) {
+			timestamps[i] = tcan4550_tcan_msg_rx_timestamp(data);
+		}
+	}
+}
+
+// rx fifo read in overwrite mode (F0OM), same sequence as
+// tcan4550_rec_msgs_overwrite in the kernel driver. Msgs are decoded into
+// frames while read, the stale ones are removed after the get index has been
+// read again.
+static int tcan4550_pmd_rx_overwrite(struct tcan4550_pmd *pmd,
+				     struct can_frame *frames,
+				     uint32_t *timestamps, int maxFrames,
+				     uint32_t fillLevel, uint32_t firstIndex)
+{
+	uint32_t skipped = tcan4550_rx_overwrite_skip(fillLevel);
+	uint32_t getIndex = (firstIndex + skipped) % RX_FIFO_SIZE;
+	uint32_t msgsToGet = fillLevel - skipped;
+	uint32_t msgsRead = 0, stale, dropped, rxf0s, ack, msgs;
+	int ret;
+
+	if (fillLevel == 0) {
+		return 0;
+	}
+
+	if (msgsToGet > (uint32_t)maxFrames) {
+		msgsToGet = maxFrames;
+	}
+
+	while (msgsRead < msgsToGet) {
+		msgs = msgsToGet - msgsRead;
+		if (msgs > TCAN4550_PMD_MAX_BURST) {
+			msgs = TCAN4550_PMD_MAX_BURST;
+		}
+		if (msgs > RX_FIFO_SIZE - getIndex) {
+			msgs = RX_FIFO_SIZE - getIndex;
+		}
+
+		// nothing is acknowledged, the msgs are read again on the next call
+		ret = spi_read_msgs(pmd, tcan4550_rx_elem_address(getIndex), msgs,
+				    false, 0);
+		if (ret) {
+			return ret;
+		}
+
+		tcan4550_pmd_decode(pmd, msgs, &frames[msgsRead],
+				    timestamps ? &timestamps[msgsRead] : NULL);
+
+		msgsRead += msgs;
+		getIndex = (getIndex + msgs) % RX_FIFO_SIZE;
+	}
+
+	ret = tcan4550_pmd_read32(pmd, RXF0S, &rxf0s);
+	if (ret) {
+		return ret;
+	}
+
+	stale = tcan4550_rx_overwrite_stale(firstIndex,
+					    tcan4550_rxf0s_get_index(rxf0s),
+					    skipped, msgsRead);
+	pmd->stats.rx_overwritten += stale;
+
+	// stale msgs that were read are at the start of frames
+	dropped = stale - skipped;
+	memmove(frames, &frames[dropped], (msgsRead - dropped) * sizeof(*frames));
+	if (timestamps) {
+		memmove(timestamps, &timestamps[dropped],
+			(msgsRead - dropped) * sizeof(*timestamps));
+	}
+
+	if (tcan4550_rx_overwrite_ack(firstIndex, stale, skipped, msgsRead,
+				      &ack)) {
+		ret = tcan4550_pmd_write32(pmd, RXF0A, ack);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	pmd->stats.rx_packets += msgsRead - dropped;
+
+	return msgsRead - dropped;
+}
+
+int tcan4550_pmd_rx_burst(struct tcan4550_pmd *pmd, struct can_frame *frames,
+			  uint32_t *timestamps, int maxFrames)
+{
+	uint32_t rxf0s;
+	uint32_t fillLevel, getIndex;
+	uint32_t msgs;
+	int received = 0;
+	int ret;
+
+	ret = tcan4550_pmd_read32(pmd, RXF0S, &rxf0s);
+	if (ret) {
+		return ret;
+	}
+
+	fillLevel = tcan4550_rxf0s_fill_level(rxf0s);
+	getIndex = tcan4550_rxf0s_get_index(rxf0s);
+
+	if (pmd->rx_overwrite) {
+		return tcan4550_pmd_rx_overwrite(pmd, frames, timestamps,
+						 maxFrames, fillLevel, getIndex);
+	}
+
+	// one SPI message per burst, a second one if the hw rx fifo wraps around
+	while ((fillLevel > 0) && (received < maxFrames)) {
+		msgs = fillLevel;
+		if (msgs > (uint32_t)(maxFrames - received)) {
+			msgs = maxFrames - received;
+		}
+		if (msgs > TCAN4550_PMD_MAX_BURST) {
+			msgs = TCAN4550_PMD_MAX_BURST;
+		}
+		if (msgs > RX_FIFO_SIZE - getIndex) {
+			msgs = RX_FIFO_SIZE - getIndex;
+		}
+
+		// acknowledge the last message we read, that will automatically
+		// free all messages up until that message
+		ret = spi_read_msgs(pmd, tcan4550_rx_elem_address(getIndex),
+				    msgs, true, getIndex + msgs - 1);
+		if (ret) {
+			return received ? received : ret;
+		}
+
+		tcan4550_pmd_decode(pmd, msgs, &frames[received],
+				    timestamps ? &timestamps[received] : NULL);
+
+		received += msgs;
+		pmd->stats.rx_packets += msgs;
+		fillLevel -= msgs;
+		getIndex = (getIndex + msgs) % RX_FIFO_SIZE;
+	}
+
+	return received;
+}
+
+int tcan4550_pmd_tx_burst(struct tcan4550_pmd *pmd,
+			  const struct can_frame *frames, int numFrames)
+{
+	uint32_t txqfs;
+	uint32_t writeIndex;
+	uint32_t requestMask;
+	uint32_t msgs, i;
+	int queued = 0;
+	int ret;
+
+	while (queued < numFrames) {
+		ret = tcan4550_pmd_read32(pmd, TXQFS, &txqfs);
+		if (ret) {
+			return queued ? queued : ret;
+		}
+
+		writeIndex = tcan4550_txqfs_put_index(txqfs);
+		msgs = tcan4550_txqfs_free_level(txqfs);
+		if (msgs > (uint32_t)(numFrames - queued)) {
+			msgs = numFrames - queued;
+		}
+		if (msgs > TCAN4550_PMD_MAX_BURST) {
+			msgs = TCAN4550_PMD_MAX_BURST;
+		}
+
+		// Make sure TX buffer does not wrap around
+		if (msgs > TX_FIFO_SIZE - writeIndex) {
+			msgs = TX_FIFO_SIZE - writeIndex;
+		}
+
+		if (msgs == 0) {
+			break;
+		}
+
+		requestMask = 0;
+		for (i = 0; i < msgs; i++) {
+			tcan4550_can_frame_to_tcan_msg(&frames[queued + i],
+						       &pmd->elems[i * 4]);
+			requestMask += (1UL << (writeIndex + i));
+		}
+
+		ret = spi_write_msgs_request(pmd, tcan4550_tx_elem_address(writeIndex),
+					     msgs, pmd->elems, requestMask);
+		if (ret) {
+			return queued ? queued : ret;
+		}
+
+		queued += msgs;
+		pmd->stats.tx_packets += msgs;
+	}
+
+	return queued;
+}
+
+int tcan4550_pmd_status(struct tcan4550_pmd *pmd, uint32_t *ir, uint32_t *psr,
+			uint32_t *ecr)
+{
+	uint32_t val;
+	int ret;
+
+	ret = tcan4550_pmd_read32(pmd, IR, &val);
+	if (!ret && val) {
+		ret = tcan4550_pmd_write32(pmd, IR, val); // acknowledge interrupts
+	}
+	if (!ret && ir) {
+		*ir = val;
+	}
+	if (!ret && psr) {
+		ret = tcan4550_pmd_read32(pmd, PSR, psr);
+	}
+	if (!ret && ecr) {
+		ret = tcan4550_pmd_read32(pmd, ECR, ecr);
+	}
+
+	return ret;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+// User space polled mode driver (PMD) for TI TCAN4550. Bypasses the network
+// stack: the application busy-polls the chip over an SPI backend and sends
+// and receives msgs in batches. Uses the same register definitions, message
+// RAM layout and element codec as the kernel driver (tcan4550_hw.h).
+// Copyright (C) 2023 CrossControl
+
+#ifndef TCAN4550_PMD_H
+#define TCAN4550_PMD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+#include "tcan4550_spi.h"
+
+// SPI burst settings. User adjustable.
+#define TCAN4550_PMD_MAX_BURST 32 // Max CAN messages in a SPI read or write
+
+#define TCAN4550_PMD_CLOCK_HZ 40000000 // CAN clock of the chip
+
+struct tcan4550_pmd_config {
+	// bit timing in time quanta of the CAN clock, see tcan4550_pmd_bittiming
+	uint32_t brp;
+	uint32_t tseg1; // prop_seg + phase_seg1
+	uint32_t tseg2; // phase_seg2
+	uint32_t sjw;
+
+	uint32_t ts_prescaler; // CAN bit times per timestamp counter tick (1 - 16)
+
+	bool loopback; // internal loopback, msgs are not sent on the bus
+	bool listen_only;
+	bool one_shot; // no automatic retransmission
+	bool rx_overwrite; // new msgs overwrite the oldest msg when rx fifo is full
+};
+
+struct tcan4550_pmd_stats {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_invalid; // rx msgs with invalid length
+	uint64_t rx_overwritten; // rx msgs overwritten in overwrite mode, skipped or read stale
+	uint64_t spi_errors;
+};
+
+struct tcan4550_pmd {
+	struct tcan4550_spi *spi;
+	struct tcan4550_pmd_stats stats;
+	bool rx_overwrite; // rx fifo in overwrite mode, from tcan4550_pmd_config
+
+	uint8_t txBuf[4 + (TCAN4550_PMD_MAX_BURST * 16)];
+	uint8_t rxBuf[4 + (TCAN4550_PMD_MAX_BURST * 16)];
+	uint8_t ackTxBuf[8];
+	uint8_t ackRxBuf[8];
+	uint32_t elems[TCAN4550_PMD_MAX_BURST * 4];
+};
+
+// fill in default bit timing (sample point 80%) for bitrate. Returns -EINVAL
+// if bitrate cannot be derived from the CAN clock.
+int tcan4550_pmd_bittiming(uint32_t bitrate, struct tcan4550_pmd_config *cfg);
+
+// identify and configure the chip and set it in normal mode, same sequence as
+// tcan4550_init in the kernel driver. The interrupt line is not used.
+int tcan4550_pmd_init(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi,
+		      const struct tcan4550_pmd_config *cfg);
+
+// set chip in standby mode
+int tcan4550_pmd_stop(struct tcan4550_pmd *pmd);
+
+// receive up to maxFrames msgs. Raw rx timestamps are stored in timestamps
+// if not NULL. Returns the number of msgs received or negative errno. In rx
+// overwrite mode msgs overwritten before or while being read are dropped and
+// counted in stats.rx_overwritten.
+int tcan4550_pmd_rx_burst(struct tcan4550_pmd *pmd, struct can_frame *frames,
+			  uint32_t *timestamps, int maxFrames);
+
+// queue up to numFrames msgs for transmission. Returns the number of msgs
+// queued, less than numFrames when the tx fifo is full, or negative errno.
+int tcan4550_pmd_tx_burst(struct tcan4550_pmd *pmd,
+			  const struct can_frame *frames, int numFrames);
+
+// read and acknowledge the interrupt register and read protocol status and
+// error counters. Any pointer may be NULL.
+int tcan4550_pmd_status(struct tcan4550_pmd *pmd, uint32_t *ir, uint32_t *psr,
+			uint32_t *ecr);
+
+// register access
+int tcan4550_pmd_read32(struct tcan4550_pmd *pmd, uint32_t address,
+			uint32_t *data);
+int tcan4550_pmd_write32(struct tcan4550_pmd *pmd, uint32_t address,
+			 uint32_t data);
+
+#endif
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0
+// Tests of the TCAN4550 user space polled mode driver against the mock SPI
+// backend: loopback, rx fifo wraparound, rx overwrite mode, msgs overwritten
+// during a read and tx.
+// Run with make test.
+// Copyright (C) 2023 CrossControl
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../tcan4550_hw.h"
+#include "tcan4550_pmd.h"
+
+#define TEST_ROUNDS 5 // loopback rounds, wraps the rx fifo several times
+#define TEST_BURST 50 // msgs per loopback round, more than one SPI burst
+#define TEST_FRAMES (TEST_ROUNDS * TEST_BURST)
+
+static int failures;
+
+#define CHECK(cond)                                                          \
+	do {                                                                 \
+		if (!(cond)) {                                               \
+			printf("%s:%d: check failed: %s\n", __FILE__,      \
+			       __LINE__, #cond);                             \
+			failures++;                                          \
+		}                                                            \
+	} while (0)
+
+// alternating extended and standard ids, all lengths
+static void make_frame(struct can_frame *frame, uint32_t n)
+{
+	uint32_t i;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->can_id = (n & 1) ? ((0x1000000 + n) | CAN_EFF_FLAG) : (n & 0x7FF);
+	frame->len = n % 9;
+	for (i = 0; i < frame->len; i++) {
+		frame->data[i] = n + i;
+	}
+}
+
+static bool same_frame(const struct can_frame *a, const struct can_frame *b)
+{
+	return (a->can_id == b->can_id) && (a->len == b->len) &&
+	       (memcmp(a->data, b->data, a->len) == 0);
+}
+
+static int init(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi,
+		bool loopback, bool rxOverwrite)
+{
+	struct tcan4550_pmd_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	if (tcan4550_pmd_bittiming(500000, &cfg)) {
+		return -EINVAL;
+	}
+	cfg.loopback = loopback;
+	cfg.rx_overwrite = rxOverwrite;
+
+	return tcan4550_pmd_init(pmd, spi, &cfg);
+}
+
+// msgs sent in internal loopback are received in order
+static void test_loopback(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi)
+{
+	static struct can_frame tx[TEST_FRAMES], rx[TEST_FRAMES];
+	struct can_frame frame;
+	int round, sent = 0, received = 0, i, n;
+
+	CHECK(init(pmd, spi, true, false) == 0);
+
+	for (i = 0; i < TEST_FRAMES; i++) {
+		make_frame(&tx[i], i);
+	}
+
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		n = tcan4550_pmd_tx_burst(pmd, &tx[sent], TEST_BURST);
+		CHECK(n == TEST_BURST);
+		sent += (n > 0) ? n : 0;
+
+		n = tcan4550_pmd_rx_burst(pmd, &rx[received], NULL, TEST_BURST);
+		CHECK(n == TEST_BURST);
+		received += (n > 0) ? n : 0;
+	}
+
+	CHECK(received == sent);
+	for (i = 0; i < received; i++) {
+		CHECK(same_frame(&rx[i], &tx[i]));
+	}
+
+	// loopback msgs are not sent on the bus
+	CHECK(tcan4550_mock_pop_tx(spi, &frame) == -EAGAIN);
+	CHECK(pmd->stats.rx_invalid == 0);
+}
+
+// a full rx fifo blocks new msgs, reads continue across the fifo wraparound
+static void test_rx_wraparound(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi)
+{
+	struct can_frame frame, rx[RX_FIFO_SIZE];
+	uint32_t accepted = 0, i;
+	int n;
+
+	CHECK(init(pmd, spi, false, false) == 0);
+
+	for (i = 0; i < RX_FIFO_SIZE + 6; i++) {
+		make_frame(&frame, i);
+		if (tcan4550_mock_inject(spi, &frame) == 0) {
+			accepted++;
+		}
+	}
+	CHECK(accepted == RX_FIFO_SIZE);
+
+	n = tcan4550_pmd_rx_burst(pmd, rx, NULL, 10);
+	CHECK(n == 10);
+	for (i = 0; (int)i < n; i++) {
+		make_frame(&frame, i);
+		CHECK(same_frame(&rx[i], &frame));
+	}
+
+	// free elements are at the start of the fifo now
+	for (i = 0; i < 10; i++) {
+		make_frame(&frame, RX_FIFO_SIZE + i);
+		CHECK(tcan4550_mock_inject(spi, &frame) == 0);
+	}
+
+	n = tcan4550_pmd_rx_burst(pmd, rx, NULL, RX_FIFO_SIZE);
+	CHECK(n == RX_FIFO_SIZE);
+	for (i = 0; (int)i < n; i++) {
+		make_frame(&frame, 10 + i);
+		CHECK(same_frame(&rx[i], &frame));
+	}
+
+	CHECK(tcan4550_pmd_rx_burst(pmd, rx, NULL, RX_FIFO_SIZE) == 0);
+}
+
+// in overwrite mode a full rx fifo keeps the newest msgs
+static void test_rx_overwrite(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi)
+{
+	struct can_frame frame, rx[RX_FIFO_SIZE];
+	uint32_t i;
+	int n;
+
+	CHECK(init(pmd, spi, false, true) == 0);
+
+	for (i = 0; i < RX_FIFO_SIZE + 6; i++) {
+		make_frame(&frame, i);
+		CHECK(tcan4550_mock_inject(spi, &frame) == 0);
+	}
+
+	// the oldest msg is the next to be overwritten and is skipped
+	n = tcan4550_pmd_rx_burst(pmd, rx, NULL, RX_FIFO_SIZE);
+	CHECK(n == RX_FIFO_SIZE - 1);
+	for (i = 0; (int)i < n; i++) {
+		make_frame(&frame, 7 + i);
+		CHECK(same_frame(&rx[i], &frame));
+	}
+	CHECK(pmd->stats.rx_overwritten == 1);
+}
+
+// in overwrite mode msgs received while the full fifo is read advance the get
+// index, msgs it has moved past are dropped and the rest kept in order
+static void test_rx_overwrite_during_read(struct tcan4550_pmd *pmd,
+					  struct tcan4550_spi *spi)
+{
+	struct can_frame frame, late[3], rx[RX_FIFO_SIZE];
+	uint32_t i;
+	int n;
+
+	CHECK(init(pmd, spi, false, true) == 0);
+
+	for (i = 0; i < RX_FIFO_SIZE; i++) {
+		make_frame(&frame, i);
+		CHECK(tcan4550_mock_inject(spi, &frame) == 0);
+	}
+
+	// overwrite msgs 0 - 2 after msg 1 has been read, msg 2 is read after
+	// it has been overwritten by late msg 2
+	for (i = 0; i < 3; i++) {
+		make_frame(&late[i], RX_FIFO_SIZE + i);
+	}
+	CHECK(tcan4550_mock_inject_during_read(spi, late, 3) == 0);
+
+	n = tcan4550_pmd_rx_burst(pmd, rx, NULL, RX_FIFO_SIZE);
+	CHECK(n == RX_FIFO_SIZE - 3);
+	for (i = 0; (int)i < n; i++) {
+		make_frame(&frame, 3 + i);
+		CHECK(same_frame(&rx[i], &frame));
+	}
+	CHECK(pmd->stats.rx_overwritten == 3);
+
+	// the late msgs are left in the fifo
+	n = tcan4550_pmd_rx_burst(pmd, rx, NULL, RX_FIFO_SIZE);
+	CHECK(n == 3);
+	for (i = 0; (int)i < n; i++) {
+		CHECK(same_frame(&rx[i], &late[i]));
+	}
+}
+
+// msgs are sent on the bus in order
+static void test_tx(struct tcan4550_pmd *pmd, struct tcan4550_spi *spi)
+{
+	struct can_frame tx[3], frame;
+	uint32_t i;
+
+	CHECK(init(pmd, spi, false, false) == 0);
+
+	for (i = 0; i < 3; i++) {
+		make_frame(&tx[i], 100 + i);
+	}
+	CHECK(tcan4550_pmd_tx_burst(pmd, tx, 3) == 3);
+
+	for (i = 0; i < 3; i++) {
+		CHECK(tcan4550_mock_pop_tx(spi, &frame) == 0);
+		CHECK(same_frame(&frame, &tx[i]));
+	}
+	CHECK(tcan4550_mock_pop_tx(spi, &frame) == -EAGAIN);
+
+	CHECK(tcan4550_pmd_stop(pmd) == 0);
+}
+
+int main(void)
+{
+	static struct tcan4550_pmd pmd;
+	struct tcan4550_spi *spi = tcan4550_mock_open();
+
+	if (!spi) {
+		printf("tcan4550_mock_open failed\n");
+		return 1;
+	}
+
+	test_loopback(&pmd, spi);
+	test_rx_wraparound(&pmd, spi);
+	test_rx_overwrite(&pmd, spi);
+	test_rx_overwrite_during_read(&pmd, spi);
+	test_tx(&pmd, spi);
+
+	spi->close(spi);
+
+	printf("%s\n", failures ? "FAIL" : "PASS");
+
+	return failures ? 1 : 0;
+}
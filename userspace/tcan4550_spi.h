@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+// SPI backends of the TCAN4550 user space polled mode driver
+// Copyright (C) 2023 CrossControl
+
+#ifndef TCAN4550_SPI_H
+#define TCAN4550_SPI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+#define TCAN4550_SPI_MAX_XFERS 4 // Max transfers in one SPI message
+
+// One SPI command. Chip select is released between the transfers of a
+// message, as the chip executes one command per chip select.
+struct tcan4550_spi_xfer {
+	const uint8_t *tx;
+	uint8_t *rx;
+	size_t len;
+};
+
+// SPI backend, embedded first in the private struct of each backend
+struct tcan4550_spi {
+	// execute numXfers transfers in order. Returns 0 or negative errno.
+	int (*transfer)(struct tcan4550_spi *spi,
+			const struct tcan4550_spi_xfer *xfers, int numXfers);
+	void (*close)(struct tcan4550_spi *spi);
+};
+
+// Linux spidev backend, e.g. path /dev/spidev0.0. The device must not be
+// bound to the kernel driver at the same time.
+struct tcan4550_spi *tcan4550_spidev_open(const char *path, uint32_t speedHz);
+
+// Mock backend emulating the registers, message RAM and fifos of a chip so
+// the polled mode driver can be used without hardware. Transmitted msgs
+// are kept in a log read with tcan4550_mock_pop_tx, and are also received
+// when the chip is configured in loopback mode.
+struct tcan4550_spi *tcan4550_mock_open(void);
+
+// put msg in rx fifo as if it was received from the bus. Returns -ENOSPC if
+// the rx fifo is full and not in overwrite mode.
+int tcan4550_mock_inject(struct tcan4550_spi *spi, const struct can_frame *frame);
+
+// put numFrames msgs in rx fifo as if they were received from the bus while
+// the next SPI read of rx fifo elements is in progress, after its first
+// element has been read. Returns -EINVAL if more than 8 msgs are pending.
+int tcan4550_mock_inject_during_read(struct tcan4550_spi *spi,
+				     const struct can_frame *frames,
+				     uint32_t numFrames);
+
+// get oldest msg sent on the bus. Returns -EAGAIN if there is none.
+int tcan4550_mock_pop_tx(struct tcan4550_spi *spi, struct can_frame *frame);
+
+#endif
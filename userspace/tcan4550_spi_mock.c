@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: GPL-2.0
+// Mock SPI backend of the TCAN4550 user space polled mode driver. Emulates
+// the registers, message RAM, rx fifo 0 and tx fifo of a chip as far as the
+// polled mode driver uses them. Frames are transmitted as soon as they are
+// requested.
+// Copyright (C) 2023 CrossControl
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../tcan4550_hw.h"
+#include "tcan4550_spi.h"
+
+#define MOCK_REGS_WORDS (0x1100 / 4) // registers 0x0000 - 0x10FF
+#define MOCK_MRAM_WORDS 0x200 // 2kB message RAM, same as MRAM_SIZE_WORDS
+#define MOCK_TX_LOG_SIZE 256 // frames sent on the bus kept for tcan4550_mock_pop_tx
+#define MOCK_PENDING_SIZE 8 // frames received during the next rx fifo read
+
+struct tcan4550_mock {
+	struct tcan4550_spi spi; // must be located first
+	uint32_t regs[MOCK_REGS_WORDS];
+	uint32_t mram[MOCK_MRAM_WORDS];
+
+	uint32_t rxGetIndex;
+	uint32_t rxFillLevel;
+	bool rxLost;
+	struct can_frame rxPending[MOCK_PENDING_SIZE];
+	uint32_t rxPendingNum;
+
+	uint32_t txGetIndex;
+	uint32_t txFillLevel;
+	uint32_t txPending; // requested tx buffers
+
+	struct can_frame txLog[MOCK_TX_LOG_SIZE];
+	uint32_t txLogHead;
+	uint32_t txLogTail;
+};
+
+static bool mock_normal_mode(struct tcan4550_mock *mock)
+{
+	return (mock->regs[MODES_OF_OPERATION / 4] & (MODESEL_1 | MODESEL_2)) ==
+	       MODESEL_2;
+}
+
+static uint32_t *mock_mram(struct tcan4550_mock *mock, uint32_t address)
+{
+	return &mock->mram[((address - MRAM_BASE) / 4) % MOCK_MRAM_WORDS];
+}
+
+// store msg in rx fifo 0, rx timestamp is the current timestamp counter value
+static int mock_receive(struct tcan4550_mock *mock, const struct can_frame *frame)
+{
+	uint32_t elem[4];
+	uint32_t putIndex;
+	uint32_t i;
+
+	if (mock->rxFillLevel == RX_FIFO_SIZE) {
+		mock->regs[IR / 4] |= RF0LE;
+
+		if (!(mock->regs[RXF0C / 4] & F0OM)) {
+			mock->rxLost = true;
+			return -ENOSPC;
+		}
+
+		// overwrite oldest msg
+		mock->rxGetIndex = (mock->rxGetIndex + 1) % RX_FIFO_SIZE;
+		mock->rxFillLevel--;
+	}
+
+	tcan4550_can_frame_to_tcan_msg(frame, elem);
+	elem[1] |= mock->regs[TSCV / 4] & 0xFFFF;
+	mock->regs[TSCV / 4] = (mock->regs[TSCV / 4] + 1) & 0xFFFF;
+
+	putIndex = (mock->rxGetIndex + mock->rxFillLevel) % RX_FIFO_SIZE;
+	for (i = 0; i < 4; i++) {
+		*mock_mram(mock, tcan4550_rx_elem_address(putIndex) + (i * 4)) =
+			elem[i];
+	}
+
+	mock->rxFillLevel++;
+	mock->regs[IR / 4] |= RF0N;
+
+	return 0;
+}
+
+// true if address is the last word of an rx fifo element
+static bool mock_rx_elem_end(uint32_t address)
+{
+	uint32_t start = tcan4550_rx_elem_address(0);
+
+	return (address >= start) &&
+	       (address < tcan4550_rx_elem_address(RX_FIFO_SIZE)) &&
+	       (((address - start) % RX_SLOT_SIZE) == (RX_SLOT_SIZE - 4));
+}
+
+static uint32_t mock_rxf0s(struct tcan4550_mock *mock)
+{
+	uint32_t putIndex = (mock->rxGetIndex + mock->rxFillLevel) % RX_FIFO_SIZE;
+
+	return mock->rxFillLevel + (mock->rxGetIndex << 8) + (putIndex << 16) +
+	       ((mock->rxFillLevel == RX_FIFO_SIZE) ? (1UL << 24) : 0) +
+	       (mock->rxLost ? (1UL << 25) : 0);
+}
+
+static uint32_t mock_txqfs(struct tcan4550_mock *mock)
+{
+	uint32_t putIndex = (mock->txGetIndex + mock->txFillLevel) % TX_FIFO_SIZE;
+
+	return (TX_FIFO_SIZE - mock->txFillLevel) + (mock->txGetIndex << 8) +
+	       (putIndex << 16) +
+	       ((mock->txFillLevel == TX_FIFO_SIZE) ? (1UL << 21) : 0);
+}
+
+// transmit requested msgs in fifo order when in normal mode
+static void mock_transmit(struct tcan4550_mock *mock)
+{
+	uint32_t test = mock->regs[TEST / 4];
+	uint32_t cccr = mock->regs[CCCR / 4];
+
+	if (!mock_normal_mode(mock)) {
+		return;
+	}
+
+	while (mock->txPending & (1UL << mock->txGetIndex)) {
+		uint32_t elem[4];
+		struct can_frame frame;
+		uint32_t i;
+
+		for (i = 0; i < 4; i++) {
+			elem[i] = *mock_mram(mock, tcan4550_tx_elem_address(mock->txGetIndex) +
+						   (i * 4));
+		}
+
+		memset(&frame, 0, sizeof(frame));
+		tcan4550_tcan_msg_to_can_frame(elem, &frame);
+
+		// internal loopback, msg is received but not sent on the bus
+		if ((cccr & TEST_EN) && (test & LBCK)) {
+			mock_receive(mock, &frame);
+		}
+
+		if (!(cccr & MON)) {
+			mock->txLog[mock->txLogHead] = frame;
+			mock->txLogHead = (mock->txLogHead + 1) % MOCK_TX_LOG_SIZE;
+			if (mock->txLogHead == mock->txLogTail) {
+				mock->txLogTail = (mock->txLogTail + 1) % MOCK_TX_LOG_SIZE;
+			}
+		}
+
+		mock->txPending &= ~(1UL << mock->txGetIndex);
+		mock->regs[TXBTO / 4] |= (1UL << mock->txGetIndex);
+		mock->txGetIndex = (mock->txGetIndex + 1) % TX_FIFO_SIZE;
+		mock->txFillLevel--;
+		mock->regs[IR / 4] |= TC;
+	}
+
+	if (mock->txFillLevel == 0) {
+		mock->regs[IR / 4] |= TFE;
+	}
+}
+
+static uint32_t mock_read32(struct tcan4550_mock *mock, uint32_t address)
+{
+	if (address >= MRAM_BASE) {
+		return *mock_mram(mock, address);
+	}
+
+	if (address == DEVICE_ID1) {
+		return TCAN_ID;
+	} else if (address == DEVICE_ID2) {
+		return TCAN_ID2;
+	} else if (address == RXF0S) {
+		return mock_rxf0s(mock);
+	} else if (address == TXQFS) {
+		return mock_txqfs(mock);
+	}
+
+	return mock->regs[(address / 4) % MOCK_REGS_WORDS];
+}
+
+static void mock_write32(struct tcan4550_mock *mock, uint32_t address,
+			 uint32_t data)
+{
+	uint32_t ackIndex;
+
+	if (address >= MRAM_BASE) {
+		*mock_mram(mock, address) = data;
+		return;
+	}
+
+	if ((address == IR) || (address == INTERRUPT_FLAGS) || (address == STATUS)) {
+		// write 1 to clear
+		mock->regs[address / 4] &= ~data;
+	} else if (address == RXF0A) {
+		// acknowledge frees all msgs up until and including the given index
+		ackIndex = data % RX_FIFO_SIZE;
+		if (mock->rxFillLevel > 0) {
+			uint32_t freed = ((ackIndex + RX_FIFO_SIZE - mock->rxGetIndex) %
+					  RX_FIFO_SIZE) + 1;
+
+			if (freed <= mock->rxFillLevel) {
+				mock->rxGetIndex = (ackIndex + 1) % RX_FIFO_SIZE;
+				mock->rxFillLevel -= freed;
+			}
+		}
+		mock->regs[address / 4] = data;
+	} else if (address == TXBAR) {
+		// buffers are added to the fifo at the put index
+		while (mock->txFillLevel < TX_FIFO_SIZE) {
+			uint32_t putIndex = (mock->txGetIndex + mock->txFillLevel) %
+					    TX_FIFO_SIZE;
+
+			if (!(data & (1UL << putIndex))) {
+				break;
+			}
+
+			mock->txPending |= (1UL << putIndex);
+			mock->txFillLevel++;
+		}
+		mock_transmit(mock);
+	} else if (address == MODES_OF_OPERATION) {
+		mock->regs[address / 4] = data;
+
+		// normal mode ends initialization of the CAN controller
+		if (mock_normal_mode(mock)) {
+			mock->regs[CCCR / 4] &= ~((uint32_t)(INIT | CCE));
+			mock_transmit(mock);
+		}
+	} else {
+		mock->regs[(address / 4) % MOCK_REGS_WORDS] = data;
+	}
+}
+
+// one SPI command: command, 16-bit address, length in words, then data words
+// most significant byte first. The chip answers status in the first word.
+static int mock_command(struct tcan4550_mock *mock,
+			const struct tcan4550_spi_xfer *xfer)
+{
+	uint32_t address, words, data, i;
+	const uint8_t *tx = xfer->tx;
+	uint8_t *rx = xfer->rx;
+
+	if (xfer->len < 4) {
+		return -EINVAL;
+	}
+
+	address = (tx[1] << 8) + tx[2];
+	words = tx[3] ? tx[3] : 256;
+
+	if (xfer->len < 4 + (words * 4)) {
+		return -EINVAL;
+	}
+
+	memset(rx, 0, xfer->len);
+
+	for (i = 0; i < words; i++) {
+		if (tx[0] == SPI_READ_COMMAND) {
+			data = mock_read32(mock, address + (i * 4));
+			rx[4 + (i * 4) + 0] = (data >> 24) & 0xFF;
+			rx[4 + (i * 4) + 1] = (data >> 16) & 0xFF;
+			rx[4 + (i * 4) + 2] = (data >> 8) & 0xFF;
+			rx[4 + (i * 4) + 3] = data & 0xFF;
+
+			// msgs received while the rx fifo is being read
+			if ((mock->rxPendingNum > 0) &&
+			    mock_rx_elem_end(address + (i * 4))) {
+				uint32_t j;
+
+				for (j = 0; j < mock->rxPendingNum; j++) {
+					mock_receive(mock, &mock->rxPending[j]);
+				}
+				mock->rxPendingNum = 0;
+			}
+		} else if (tx[0] == SPI_WRITE_COMMAND) {
+			data = ((uint32_t)tx[4 + (i * 4) + 0] << 24) +
+			       (tx[4 + (i * 4) + 1] << 16) +
+			       (tx[4 + (i * 4) + 2] << 8) + tx[4 + (i * 4) + 3];
+			mock_write32(mock, address + (i * 4), data);
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int tcan4550_mock_transfer(struct tcan4550_spi *spi,
+				  const struct tcan4550_spi_xfer *xfers,
+				  int numXfers)
+{
+	struct tcan4550_mock *mock = (struct tcan4550_mock *)spi;
+	int i, ret;
+
+	for (i = 0; i < numXfers; i++) {
+		ret = mock_command(mock, &xfers[i]);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void tcan4550_mock_close(struct tcan4550_spi *spi)
+{
+	free(spi);
+}
+
+struct tcan4550_spi *tcan4550_mock_open(void)
+{
+	struct tcan4550_mock *mock = calloc(1, sizeof(*mock));
+
+	if (!mock) {
+		return NULL;
+	}
+
+	// chip starts in standby mode with the CAN controller in init
+	mock->regs[MODES_OF_OPERATION / 4] = MODESEL_1;
+	mock->regs[CCCR / 4] = INIT;
+	mock->regs[INTERRUPT_FLAGS / 4] = PWRON;
+
+	mock->spi.transfer = tcan4550_mock_transfer;
+	mock->spi.close = tcan4550_mock_close;
+
+	return &mock->spi;
+}
+
+int tcan4550_mock_inject(struct tcan4550_spi *spi, const struct can_frame *frame)
+{
+	return mock_receive((struct tcan4550_mock *)spi, frame);
+}
+
+int tcan4550_mock_inject_during_read(struct tcan4550_spi *spi,
+				     const struct can_frame *frames,
+				     uint32_t numFrames)
+{
+	struct tcan4550_mock *mock = (struct tcan4550_mock *)spi;
+
+	if (mock->rxPendingNum + numFrames > MOCK_PENDING_SIZE) {
+		return -EINVAL;
+	}
+
+	memcpy(&mock->rxPending[mock->rxPendingNum], frames,
+	       numFrames * sizeof(*frames));
+	mock->rxPendingNum += numFrames;
+
+	return 0;
+}
+
+int tcan4550_mock_pop_tx(struct tcan4550_spi *spi, struct can_frame *frame)
+{
+	struct tcan4550_mock *mock = (struct tcan4550_mock *)spi;
+
+	if (mock->txLogHead == mock->txLogTail) {
+		return -EAGAIN;
+	}
+
+	*frame = mock->txLog[mock->txLogTail];
+	mock->txLogTail = (mock->txLogTail + 1) % MOCK_TX_LOG_SIZE;
+
+	return 0;
+}
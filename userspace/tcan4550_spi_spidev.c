@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0
+// Linux spidev backend of the TCAN4550 user space polled mode driver
+// Copyright (C) 2023 CrossControl
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/spi/spidev.h>
+
+#include "tcan4550_spi.h"
+
+struct tcan4550_spidev {
+	struct tcan4550_spi spi; // must be located first
+	int fd;
+	uint32_t speedHz;
+};
+
+static int tcan4550_spidev_transfer(struct tcan4550_spi *spi,
+				    const struct tcan4550_spi_xfer *xfers,
+				    int numXfers)
+{
+	struct tcan4550_spidev *dev = (struct tcan4550_spidev *)spi;
+	struct spi_ioc_transfer tr[TCAN4550_SPI_MAX_XFERS];
+	int i;
+
+	if ((numXfers <= 0) || (numXfers > TCAN4550_SPI_MAX_XFERS)) {
+		return -EINVAL;
+	}
+
+	memset(tr, 0, sizeof(tr));
+
+	for (i = 0; i < numXfers; i++) {
+		tr[i].tx_buf = (unsigned long)xfers[i].tx;
+		tr[i].rx_buf = (unsigned long)xfers[i].rx;
+		tr[i].len = xfers[i].len;
+		tr[i].speed_hz = dev->speedHz;
+		tr[i].bits_per_word = 8;
+		// release chip select between SPI commands
+		tr[i].cs_change = (i < (numXfers - 1)) ? 1 : 0;
+	}
+
+	// all transfers in one system call
+	if (ioctl(dev->fd, SPI_IOC_MESSAGE(numXfers), tr) < 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void tcan4550_spidev_close(struct tcan4550_spi *spi)
+{
+	struct tcan4550_spidev *dev = (struct tcan4550_spidev *)spi;
+
+	close(dev->fd);
+	free(dev);
+}
+
+struct tcan4550_spi *tcan4550_spidev_open(const char *path, uint32_t speedHz)
+{
+	struct tcan4550_spidev *dev;
+	uint8_t mode = SPI_MODE_0;
+	uint8_t bits = 8;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		return NULL;
+	}
+
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	if ((ioctl(dev->fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+	    (ioctl(dev->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+	    (ioctl(dev->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speedHz) < 0)) {
+		int err = errno;
+
+		close(dev->fd);
+		free(dev);
+		errno = err;
+		return NULL;
+	}
+
+	dev->speedHz = speedHz;
+	dev->spi.transfer = tcan4550_spidev_transfer;
+	dev->spi.close = tcan4550_spidev_close;
+
+	return &dev->spi;
+}